@@ -18,8 +18,13 @@
 #ifndef CSC369_EXT2_FS_H
 #define CSC369_EXT2_FS_H
 
-/* The ext2 block size used in the assignment. */
-#define EXT2_BLOCK_SIZE 1024
+/*
+ * The block size is 1024 << s_log_block_size, the tools support 1024, 2048 and 4096 byte blocks.
+ * The superblock is always 1024 bytes into the image, whatever the block size.
+ */
+#define EXT2_MIN_BLOCK_SIZE 1024
+#define EXT2_MAX_BLOCK_SIZE 4096
+#define EXT2_SUPER_BLOCK_OFFSET 1024
 
 /*
  * Structure of the super block
@@ -103,6 +108,16 @@ struct ext2_super_block {
 	unsigned int   s_reserved[190]; /* Padding to the end of the block */
 };
 
+/* The value of s_magic in every ext2 superblock. */
+#define EXT2_SUPER_MAGIC 0xEF53
+
+/* Revision 0 file systems have fixed size inodes and no s_inode_size. */
+#define EXT2_GOOD_OLD_REV 0
+#define EXT2_GOOD_OLD_INODE_SIZE 128
+
+/* s_feature_compat flag for s_prealloc_dir_blocks. */
+#define EXT2_FEATURE_COMPAT_DIR_PREALLOC 0x0001
+
 
 /*
  * Structure of a blocks group descriptor
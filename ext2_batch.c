@@ -0,0 +1,145 @@
+/**
+ * Copyright (C) 2019
+ * Omar Chehab (omarchehab98@gmail.com)
+ * University of Toronto
+ */
+#include "ext2_commands.h"
+
+#define BATCH_MAX_ARGS 4
+
+unsigned char *disk;
+
+void usage(char *program) {
+	fprintf(stderr, "usage: %s [-k] <image file name> [script]\n", program);
+}
+
+
+/**
+ * Splits the line in place on whitespace, stopping at a `#` comment, and returns the number of
+ * words, or -1 if there are more than max words.
+ */
+int split_line(char *line, char **words, int max) {
+	int count = 0;
+	char *word = strtok(line, " \t\r\n");
+
+	while (word != NULL && word[0] != '#') {
+		if (count == max) {
+			return -1;
+		}
+		words[count++] = word;
+		word = strtok(NULL, " \t\r\n");
+	}
+
+	return count;
+}
+
+
+/**
+ * Runs a single command against the disk, returns -1 on failure or 0 on success.
+ */
+int run_command(char *program, char **words, int count) {
+	char *command = words[0];
+
+	if (strcmp(command, "mkdir") == 0 && count == 2) {
+		return ext2_mkdir(program, disk, words[1]);
+	} else if (strcmp(command, "cp") == 0 && count == 3) {
+		return ext2_cp(program, disk, words[1], words[2]);
+	} else if (strcmp(command, "cp") == 0 && count == 4 && strcmp(words[1], "-r") == 0) {
+		long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		return ext2_cp_recursive(program, disk, words[2], words[3], nthreads > 0 ? nthreads : 1);
+	} else if (strcmp(command, "ln") == 0 && count == 3) {
+		return ext2_ln(program, disk, words[1], words[2], false);
+	} else if (strcmp(command, "ln") == 0 && count == 4 && strcmp(words[1], "-s") == 0) {
+		return ext2_ln(program, disk, words[2], words[3], true);
+	} else if (strcmp(command, "rm") == 0 && count == 2) {
+		return ext2_rm(program, disk, words[1]);
+	} else if (strcmp(command, "restore") == 0 && count == 2) {
+		return ext2_restore(program, disk, words[1]);
+	} else if (strcmp(command, "extract") == 0 && count == 3) {
+		return ext2_extract(program, disk, words[1], words[2]);
+	} else if (strcmp(command, "extract") == 0 && count == 4 && strcmp(words[1], "-r") == 0) {
+		long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		return ext2_extract_recursive(program, disk, words[2], words[3], nthreads > 0 ? nthreads : 1);
+	}
+
+	fprintf(stderr, "%s: %s\n", program, strerror(EINVAL));
+	return -1;
+}
+
+
+int main(int argc, char **argv) {
+	bool keep_going = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "k")) != -1) {
+		switch (opt) {
+			case 'k':
+				keep_going = true;
+				break;
+
+			default:
+				usage(get_filename(argv[0]));
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind != 1 && argc - optind != 2) {
+		usage(get_filename(argv[0]));
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *script = stdin;
+	if (argc - optind == 2) {
+		script = fopen(argv[optind + 1], "r");
+		if (script == NULL) {
+			fprintf(stderr, "%s: %s: %s\n", get_filename(argv[0]), argv[optind + 1], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	disk = load_disk(argv[optind], 0);
+
+	char *line = NULL;
+	size_t line_size = 0;
+	unsigned int line_number = 0;
+	int status = EXIT_SUCCESS;
+
+	while (getline(&line, &line_size, script) != -1) {
+		line_number++;
+
+		char *words[BATCH_MAX_ARGS];
+		int count = split_line(line, words, BATCH_MAX_ARGS);
+		if (count == 0) {
+			continue;
+		}
+
+		char program[128];
+		snprintf(program, sizeof program, "%s: line %u: %s", get_filename(argv[0]), line_number, words[0]);
+
+		int result = -1;
+		if (count == -1) {
+			fprintf(stderr, "%s: %s\n", program, strerror(E2BIG));
+		} else {
+			result = run_command(program, words, count);
+		}
+
+		if (result == -1) {
+			status = EXIT_FAILURE;
+			if (!keep_going) {
+				break;
+			}
+		}
+	}
+
+	free(line);
+	if (script != stdin) {
+		fclose(script);
+	}
+
+	if (sync_disk(disk) == -1) {
+		perror(get_filename(argv[0]));
+		exit(EXIT_FAILURE);
+	}
+
+	return status;
+}
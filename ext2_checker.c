@@ -3,33 +3,528 @@
  * Omar Chehab (omarchehab98@gmail.com)
  * University of Toronto
  */
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
 #include "ext2_utils.h"
 
 unsigned char *disk;
 
 void usage(char *program) {
-	fprintf(stderr, "usage: %s <image file name>\n", program);
+	fprintf(stderr, "usage: %s [-j jobs] [--dry-run] [--format=text|json|binary] [--incremental [--checkpoint=file]] <image file name>\n", program);
 }
 
 
+/**
+ * Everything the checker finds is recorded as a finding. In text format each finding is printed as
+ * soon as it is found, the other formats print the whole report at the end.
+ */
+enum finding_kind {
+	FINDING_SUPER_FREE_INODES,
+	FINDING_SUPER_FREE_BLOCKS,
+	FINDING_GROUP_FREE_INODES,
+	FINDING_GROUP_FREE_BLOCKS,
+	FINDING_FILE_TYPE,
+	FINDING_INODE_BITMAP,
+	FINDING_I_DTIME,
+	FINDING_DATABLOCKS,
+};
+
+char *finding_names[] = {
+	"superblock_free_inodes",
+	"superblock_free_blocks",
+	"group_free_inodes",
+	"group_free_blocks",
+	"file_type",
+	"inode_bitmap",
+	"i_dtime",
+	"datablocks",
+};
+
+struct finding {
+	enum finding_kind kind;
+	unsigned int group;
+	unsigned int inode;
+	unsigned int count;
+};
+
+enum report_format { FORMAT_TEXT, FORMAT_JSON, FORMAT_BINARY };
+
+
+/**
+ * The sidecar checkpoint that --incremental reads and writes, by default next to the image as
+ * <image>.ckpt. It holds a digest of each group's bitmaps, and for each inode table block a digest
+ * of the block, a digest of the blocks of the directories in it, and a mask of the groups the
+ * datablocks of its inodes in use are in (bit group % 64). Inodes whose table block, group inode
+ * bitmap, and the block bitmaps of the groups in that mask are unchanged since the checkpoint are
+ * not checked again, and the entries of their directories are not checked again either when the
+ * directory blocks are unchanged too, unless they refer to an inode that changed.
+ * 
+ * Telling what is unchanged still means digesting every bitmap, inode table block, and directory
+ * block, so a run reads all of the metadata. The datablocks and inodes that are walked and
+ * checked beyond that are only those that changed.
+ */
+#define CHECKPOINT_MAGIC   "E2CP"
+#define CHECKPOINT_VERSION 3
+
+struct checkpoint_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t blocks_count;
+	uint32_t inodes_count;
+	uint32_t groups;
+	uint32_t table_blocks;
+};
+
+struct checkpoint_group {
+	uint64_t inode_bitmap_digest;
+	uint64_t block_bitmap_digest;
+};
+
+struct checkpoint_table_block {
+	uint64_t digest;
+	uint64_t dir_digest;
+	uint64_t group_mask;
+};
+
+struct checkpoint {
+	struct checkpoint_header header;
+	struct checkpoint_group *groups;
+	struct checkpoint_table_block *table_blocks;
+};
+
+
 struct ext2_checker_data {
 	unsigned int total_fixes;
 	unsigned int free_inodes;
 	unsigned int free_blocks;
+	unsigned int *group_free_inodes;
+	unsigned int *group_free_blocks;
+	bool dry_run;
+	enum report_format format;
+	struct finding *findings;
+	unsigned int findings_len;
+	unsigned int findings_cap;
+	struct checkpoint *previous;
+	struct checkpoint current;
+	unsigned char *skip_table_blocks;
+	unsigned char *skip_dir_blocks;
 };
 
 
-void check_inode_bit(unsigned char *disk, unsigned int inode, void *arg) {
-	struct ext2_checker_data *checker = (struct ext2_checker_data *) arg;
-	
-	checker->free_inodes += is_inode_free(disk, inode);
+void print_finding(struct ext2_checker_data *checker, struct finding *finding) {
+	char *verb = checker->dry_run ? "Found" : "Fixed";
+
+	switch (finding->kind) {
+		case FINDING_SUPER_FREE_INODES:
+			printf("%s: superblock's free inodes counter was off by %d compared to the bitmap\n", verb, finding->count);
+			break;
+		case FINDING_SUPER_FREE_BLOCKS:
+			printf("%s: superblock's free blocks counter was off by %d compared to the bitmap\n", verb, finding->count);
+			break;
+		case FINDING_GROUP_FREE_INODES:
+			printf("%s: block group's free inodes counter was off by %d compared to the bitmap\n", verb, finding->count);
+			break;
+		case FINDING_GROUP_FREE_BLOCKS:
+			printf("%s: block group's free blocks counter was off by %d compared to the bitmap\n", verb, finding->count);
+			break;
+		case FINDING_FILE_TYPE:
+			printf("%s: Entry type vs inode mismatch: inode [%d]\n", verb, finding->inode);
+			break;
+		case FINDING_INODE_BITMAP:
+			printf("%s: inode [%d] not marked as in-use\n", verb, finding->inode);
+			break;
+		case FINDING_I_DTIME:
+			printf("%s: valid inode marked for deletion: [%d]\n", verb, finding->inode);
+			break;
+		case FINDING_DATABLOCKS:
+			printf("%s: %d in-use data blocks not marked in data bitmap for inode: [%d]\n", verb, finding->count, finding->inode);
+			break;
+	}
 }
 
 
-void check_block_bit(unsigned char *disk, unsigned int block, void *arg) {
-	struct ext2_checker_data *checker = (struct ext2_checker_data *) arg;
+/**
+ * Records a finding, fixes counts towards total_fixes as they do in the text output.
+ */
+void report_finding(struct ext2_checker_data *checker, enum finding_kind kind, unsigned int group, unsigned int inode, unsigned int count, unsigned int fixes) {
+	if (checker->findings_len == checker->findings_cap) {
+		checker->findings_cap = checker->findings_cap ? checker->findings_cap * 2 : 16;
+		checker->findings = realloc(checker->findings, checker->findings_cap * sizeof (struct finding));
+		if (checker->findings == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	struct finding *finding = &checker->findings[checker->findings_len++];
+	finding->kind = kind;
+	finding->group = group;
+	finding->inode = inode;
+	finding->count = count;
+	checker->total_fixes += fixes;
+
+	if (checker->format == FORMAT_TEXT) {
+		print_finding(checker, finding);
+	}
+}
+
+
+void print_report_json(struct ext2_checker_data *checker) {
+	printf("{\"dry_run\":%s,\"total\":%u,\"findings\":[", checker->dry_run ? "true" : "false", checker->total_fixes);
+	for (unsigned int i = 0; i < checker->findings_len; i++) {
+		struct finding *finding = &checker->findings[i];
+		printf("%s{\"kind\":\"%s\",\"group\":%u,\"inode\":%u,\"count\":%u}", i ? "," : "", finding_names[finding->kind], finding->group, finding->inode, finding->count);
+	}
+	printf("]}\n");
+}
+
+
+void put_u32(unsigned char *buffer, unsigned int value) {
+	buffer[0] = value;
+	buffer[1] = value >> 8;
+	buffer[2] = value >> 16;
+	buffer[3] = value >> 24;
+}
+
+
+/**
+ * A 16 byte header of "E2CK", version, number of records, and total, followed by a 16 byte record
+ * of kind, group, inode, and count per finding, all little endian 32 bit words.
+ */
+void print_report_binary(struct ext2_checker_data *checker) {
+	unsigned char record[16];
+
+	memcpy(record, "E2CK", 4);
+	put_u32(record + 4, 1);
+	put_u32(record + 8, checker->findings_len);
+	put_u32(record + 12, checker->total_fixes);
+	fwrite(record, sizeof record, 1, stdout);
+
+	for (unsigned int i = 0; i < checker->findings_len; i++) {
+		struct finding *finding = &checker->findings[i];
+		put_u32(record, finding->kind);
+		put_u32(record + 4, finding->group);
+		put_u32(record + 8, finding->inode);
+		put_u32(record + 12, finding->count);
+		fwrite(record, sizeof record, 1, stdout);
+	}
+}
+
+
+/**
+ * Hashes 8 bytes at a time, only meant to notice that a region changed between two runs.
+ */
+uint64_t digest(unsigned char *data, size_t len) {
+	uint64_t hash = 0xcbf29ce484222325ull ^ len;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof word);
+		hash = (hash ^ word) * 0x100000001b3ull;
+		hash ^= hash >> 29;
+	}
+	for (; i < len; i++) {
+		hash = (hash ^ data[i]) * 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+
+unsigned int inode_table_blocks(unsigned char *disk) {
+	struct ext2_super_block *s = DISK_SUPER_BLOCK(disk);
+	return (s->s_inodes_per_group * DISK_INODE_SIZE(disk) + DISK_BLOCK_SIZE(disk) - 1) / DISK_BLOCK_SIZE(disk);
+}
+
+
+/**
+ * Returns the index of the inode table block that holds the inode, over all groups.
+ */
+unsigned int inode_table_block(unsigned char *disk, unsigned int inode) {
+	unsigned int offset = INODE_GROUP_INDEX(disk, inode) * DISK_INODE_SIZE(disk);
+	return INODE_GROUP(disk, inode) * inode_table_blocks(disk) + offset / DISK_BLOCK_SIZE(disk);
+}
+
+
+void digest_dir_block(unsigned char *disk, unsigned int inode, unsigned int block, void *arg) {
+	uint64_t *hash = (uint64_t *) arg;
+	*hash = (*hash ^ digest(DISK_BLOCK(disk, BLOCK_NUMBER(disk, block)), DISK_BLOCK_SIZE(disk))) * 0x100000001b3ull;
+}
+
+
+/**
+ * Digests the blocks of every directory in use whose inode is in the group's i-th inode table
+ * block, so that a directory whose entries changed is told apart even when its inode did not.
+ */
+uint64_t digest_table_block_dirs(unsigned char *disk, unsigned int group, unsigned int i) {
+	struct ext2_super_block *s = DISK_SUPER_BLOCK(disk);
+	unsigned int inodes_per_block = DISK_BLOCK_SIZE(disk) / DISK_INODE_SIZE(disk);
+	unsigned char *inode_bitmap = DISK_INODE_BITMAP(disk, group);
+	uint64_t hash = 0;
+
+	for (unsigned int index = i * inodes_per_block; index < MIN((i + 1) * inodes_per_block, s->s_inodes_per_group); index++) {
+		unsigned int inode = group * s->s_inodes_per_group + index;
+		if (inode >= s->s_inodes_count) {
+			break;
+		}
+		if (is_bit_set_by_index(inode_bitmap, index) && S_ISDIR(inode_from_index(disk, inode)->i_mode)) {
+			uint64_t dir_hash = inode;
+			inode_block_foreach(disk, inode, &digest_dir_block, &dir_hash);
+			hash = (hash ^ dir_hash) * 0x100000001b3ull;
+		}
+	}
+
+	return hash;
+}
 
-	checker->free_blocks += is_block_free(disk, block);
+
+/**
+ * Returns the checkpoint at path, or NULL if there is none or it describes a different geometry.
+ */
+struct checkpoint *load_checkpoint(char *path) {
+	struct ext2_super_block *s = DISK_SUPER_BLOCK(disk);
+	struct checkpoint *checkpoint = calloc(1, sizeof (struct checkpoint));
+	FILE *fp = fopen(path, "rb");
+	if (checkpoint == NULL || fp == NULL) {
+		free(checkpoint);
+		return NULL;
+	}
+
+	struct checkpoint_header *header = &checkpoint->header;
+	unsigned int groups = DISK_GROUP_COUNT(disk);
+	unsigned int table_blocks = groups * inode_table_blocks(disk);
+	checkpoint->groups = calloc(groups, sizeof (struct checkpoint_group));
+	checkpoint->table_blocks = calloc(table_blocks, sizeof (struct checkpoint_table_block));
+
+	bool ok = checkpoint->groups != NULL && checkpoint->table_blocks != NULL
+		&& fread(header, sizeof (struct checkpoint_header), 1, fp) == 1
+		&& memcmp(header->magic, CHECKPOINT_MAGIC, 4) == 0
+		&& header->version == CHECKPOINT_VERSION
+		&& header->block_size == DISK_BLOCK_SIZE(disk)
+		&& header->blocks_count == s->s_blocks_count
+		&& header->inodes_count == s->s_inodes_count
+		&& header->groups == groups
+		&& header->table_blocks == inode_table_blocks(disk)
+		&& fread(checkpoint->groups, sizeof (struct checkpoint_group), groups, fp) == groups
+		&& fread(checkpoint->table_blocks, sizeof (struct checkpoint_table_block), table_blocks, fp) == table_blocks;
+	fclose(fp);
+
+	if (!ok) {
+		free(checkpoint->groups);
+		free(checkpoint->table_blocks);
+		free(checkpoint);
+		return NULL;
+	}
+
+	return checkpoint;
+}
+
+
+/**
+ * Writes the checkpoint next to path and renames it over path, so that a crash never leaves a
+ * partial checkpoint behind. Returns -1 on error.
+ */
+int save_checkpoint(char *path, struct checkpoint *checkpoint) {
+	struct checkpoint_header *header = &checkpoint->header;
+	char *tmp_path = malloc(strlen(path) + sizeof ".tmp");
+	if (tmp_path == NULL) {
+		return -1;
+	}
+	sprintf(tmp_path, "%s.tmp", path);
+
+	FILE *fp = fopen(tmp_path, "wb");
+	if (fp == NULL) {
+		free(tmp_path);
+		return -1;
+	}
+
+	unsigned int table_blocks = header->groups * header->table_blocks;
+	bool ok = fwrite(header, sizeof (struct checkpoint_header), 1, fp) == 1
+		&& fwrite(checkpoint->groups, sizeof (struct checkpoint_group), header->groups, fp) == header->groups
+		&& fwrite(checkpoint->table_blocks, sizeof (struct checkpoint_table_block), table_blocks, fp) == table_blocks;
+
+	if (fclose(fp) != 0 || !ok || rename(tmp_path, path) == -1) {
+		unlink(tmp_path);
+		free(tmp_path);
+		return -1;
+	}
+
+	free(tmp_path);
+	return 0;
+}
+
+
+/**
+ * Every stride-th group starting at first_group, so that each thread only ever writes its own
+ * groups' counters and digests.
+ */
+struct group_stripe_arg {
+	struct ext2_checker_data *checker;
+	unsigned int first_group;
+	unsigned int stride;
+};
+
+
+/**
+ * Counts the free inodes and blocks of a stripe of groups. Counting is a popcount over each
+ * bitmap.
+ * 
+ * Also digests each group's bitmaps, inode table blocks, and directories into the current
+ * checkpoint.
+ */
+void *count_groups(void *arg) {
+	struct group_stripe_arg *count = (struct group_stripe_arg *) arg;
+	struct ext2_checker_data *checker = count->checker;
+	struct ext2_super_block *s = DISK_SUPER_BLOCK(disk);
+	unsigned int inodes = s->s_inodes_count / 8 * 8;
+	unsigned int table_blocks = inode_table_blocks(disk);
+	unsigned int block_size = DISK_BLOCK_SIZE(disk);
+
+	for (unsigned int group = count->first_group; group < DISK_GROUP_COUNT(disk); group += count->stride) {
+		unsigned int first_inode = group * s->s_inodes_per_group;
+		unsigned int ninodes = first_inode < inodes ? MIN(s->s_inodes_per_group, inodes - first_inode) : 0;
+		unsigned char *inode_bitmap = DISK_INODE_BITMAP(disk, group);
+		unsigned int free_inodes = ninodes - bitmap_count_set(inode_bitmap, ninodes);
+
+		// Reserved inodes never count as free, whatever their bit says.
+		for (unsigned int inode = first_inode; inode < first_inode + ninodes && inode < EXT2_GOOD_OLD_FIRST_INO; inode++) {
+			if (is_inode_reserved(inode) && !is_bit_set_by_index(inode_bitmap, inode - first_inode)) {
+				free_inodes--;
+			}
+		}
+
+		unsigned int nblocks = group_blocks_count(disk, group);
+		unsigned char *block_bitmap = DISK_BLOCK_BITMAP(disk, group);
+		unsigned int free_blocks = nblocks - bitmap_count_set(block_bitmap, nblocks);
+
+		checker->group_free_inodes[group] = free_inodes;
+		checker->group_free_blocks[group] = free_blocks;
+
+		struct checkpoint_group *digests = &checker->current.groups[group];
+		digests->inode_bitmap_digest = digest(inode_bitmap, (s->s_inodes_per_group + 7) / 8);
+		digests->block_bitmap_digest = digest(block_bitmap, (nblocks + 7) / 8);
+
+		unsigned char *inode_table = DISK_INODE_TABLE(disk, group);
+		for (unsigned int i = 0; i < table_blocks; i++) {
+			struct checkpoint_table_block *table_digests = &checker->current.table_blocks[group * table_blocks + i];
+			table_digests->digest = digest(inode_table + (size_t) i * block_size, block_size);
+			table_digests->dir_digest = digest_table_block_dirs(disk, group, i);
+		}
+	}
+
+	return NULL;
+}
+
+
+void add_datablock_group(unsigned char *disk, unsigned int inode, unsigned int block, void *arg) {
+	*(uint64_t *) arg |= (uint64_t) 1 << (BLOCK_GROUP(disk, block) % 64);
+}
+
+
+/**
+ * Records the groups the datablocks of every inode in use are in, for each inode table block of a
+ * stripe of groups that was not carried over from the previous checkpoint. Inodes no directory
+ * leads to are included, so that the mask still holds once one does.
+ */
+void *record_group_masks(void *arg) {
+	struct group_stripe_arg *record = (struct group_stripe_arg *) arg;
+	struct ext2_checker_data *checker = record->checker;
+	struct ext2_super_block *s = DISK_SUPER_BLOCK(disk);
+	unsigned int table_blocks = inode_table_blocks(disk);
+	unsigned int inodes_per_block = DISK_BLOCK_SIZE(disk) / DISK_INODE_SIZE(disk);
+
+	for (unsigned int group = record->first_group; group < DISK_GROUP_COUNT(disk); group += record->stride) {
+		unsigned char *inode_bitmap = DISK_INODE_BITMAP(disk, group);
+
+		for (unsigned int i = 0; i < table_blocks; i++) {
+			if (is_bit_set_by_index(checker->skip_table_blocks, group * table_blocks + i)) {
+				continue;
+			}
+
+			uint64_t group_mask = 0;
+			for (unsigned int index = i * inodes_per_block; index < MIN((i + 1) * inodes_per_block, s->s_inodes_per_group); index++) {
+				unsigned int inode = group * s->s_inodes_per_group + index;
+				if (inode >= s->s_inodes_count) {
+					break;
+				}
+				if (is_bit_set_by_index(inode_bitmap, index)) {
+					inode_block_foreach(disk, inode, &add_datablock_group, &group_mask);
+				}
+			}
+			checker->current.table_blocks[group * table_blocks + i].group_mask = group_mask;
+		}
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Runs the routine over a stripe of groups on each of nthreads threads, this one included.
+ */
+void run_group_stripes(struct ext2_checker_data *checker, unsigned int nthreads, void *(*routine)(void *)) {
+	pthread_t *threads = calloc(nthreads, sizeof (pthread_t));
+	struct group_stripe_arg *stripes = calloc(nthreads, sizeof (struct group_stripe_arg));
+	if (threads == NULL || stripes == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (unsigned int i = 0; i < nthreads; i++) {
+		stripes[i].checker = checker;
+		stripes[i].first_group = i;
+		stripes[i].stride = nthreads;
+		if (i > 0 && pthread_create(&threads[i], NULL, routine, &stripes[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	(*routine)(&stripes[0]);
+	for (unsigned int i = 1; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	free(stripes);
+}
+
+
+/**
+ * Decides which inode table blocks need not be checked again, and which of those hold directories
+ * whose entries need not be checked again either, by comparing the digests just taken with the
+ * previous checkpoint. The group masks of those blocks carry over.
+ */
+void compare_checkpoint(struct ext2_checker_data *checker) {
+	struct checkpoint *previous = checker->previous;
+	unsigned int groups = DISK_GROUP_COUNT(disk);
+	unsigned int table_blocks = inode_table_blocks(disk);
+	uint64_t changed_block_groups = 0;
+
+	for (unsigned int group = 0; group < groups; group++) {
+		if (previous->groups[group].block_bitmap_digest != checker->current.groups[group].block_bitmap_digest) {
+			changed_block_groups |= (uint64_t) 1 << (group % 64);
+		}
+	}
+
+	for (unsigned int group = 0; group < groups; group++) {
+		bool inode_bitmap_same = previous->groups[group].inode_bitmap_digest == checker->current.groups[group].inode_bitmap_digest;
+
+		for (unsigned int i = group * table_blocks; i < (group + 1) * table_blocks; i++) {
+			struct checkpoint_table_block *before = &previous->table_blocks[i];
+			struct checkpoint_table_block *now = &checker->current.table_blocks[i];
+
+			if (inode_bitmap_same && before->digest == now->digest && !(before->group_mask & changed_block_groups)) {
+				set_bit_by_index(checker->skip_table_blocks, i);
+				now->group_mask = before->group_mask;
+				if (before->dir_digest == now->dir_digest) {
+					set_bit_by_index(checker->skip_dir_blocks, i);
+				}
+			}
+		}
+	}
 }
 
 
@@ -37,23 +532,25 @@ void check_dir_entry_file_type(unsigned char *disk, struct ext2_dir_entry *dir_e
 	struct ext2_checker_data *checker = (struct ext2_checker_data *) arg;
 
 	struct ext2_inode *inode_entry = inode_from_index(disk, dir_entry->inode - 1);
+	unsigned char file_type = dir_entry->file_type;
 	
 	if (dir_entry->file_type != EXT2_FT_DIR && S_ISDIR(inode_entry->i_mode)) {
-		printf("Fixed: Entry type vs inode mismatch: inode [%d]\n", dir_entry->inode);
-		dir_entry->file_type = EXT2_FT_DIR;
-		checker->total_fixes++;
+		report_finding(checker, FINDING_FILE_TYPE, 0, dir_entry->inode, 0, 1);
+		file_type = EXT2_FT_DIR;
 	}
 
 	if (dir_entry->file_type != EXT2_FT_SYMLINK && S_ISLNK(inode_entry->i_mode)) {
-		printf("Fixed: Entry type vs inode mismatch: inode [%d]\n", dir_entry->inode);
-		dir_entry->file_type = EXT2_FT_SYMLINK;
-		checker->total_fixes++;
+		report_finding(checker, FINDING_FILE_TYPE, 0, dir_entry->inode, 0, 1);
+		file_type = EXT2_FT_SYMLINK;
 	}
 
 	if (dir_entry->file_type != EXT2_FT_REG_FILE && S_ISREG(inode_entry->i_mode)) {
-		printf("Fixed: Entry type vs inode mismatch: inode [%d]\n", dir_entry->inode);
-		dir_entry->file_type = EXT2_FT_REG_FILE;
-		checker->total_fixes++;
+		report_finding(checker, FINDING_FILE_TYPE, 0, dir_entry->inode, 0, 1);
+		file_type = EXT2_FT_REG_FILE;
+	}
+
+	if (!checker->dry_run && file_type != dir_entry->file_type) {
+		dir_entry->file_type = file_type;
 	}
 }
 
@@ -61,17 +558,13 @@ void check_dir_entry_file_type(unsigned char *disk, struct ext2_dir_entry *dir_e
 void check_dir_entry_inode(unsigned char *disk, struct ext2_dir_entry *dir_entry, void *arg) {
 	struct ext2_checker_data *checker = (struct ext2_checker_data *) arg;
 
-	struct ext2_super_block *s = DISK_SUPER_BLOCK(disk);
-	struct ext2_group_desc *bg = DISK_GROUP_DESC(disk);
-	unsigned char *ib = DISK_INODE_BITMAP(disk);
+	unsigned char *ib = DISK_INODE_BITMAP(disk, INODE_GROUP(disk, dir_entry->inode - 1));
 
-	if (!is_bit_set_by_index(ib, dir_entry->inode - 1)) {
-		printf("Fixed: inode [%d] not marked as in-use\n", dir_entry->inode);
-		set_bit_by_index(ib, dir_entry->inode - 1);
-		s->s_free_inodes_count--;
-		bg->bg_free_inodes_count--;
-		checker->free_inodes++;
-		checker->total_fixes++;
+	if (!is_bit_set_by_index(ib, INODE_GROUP_INDEX(disk, dir_entry->inode - 1))) {
+		report_finding(checker, FINDING_INODE_BITMAP, 0, dir_entry->inode, 0, 1);
+		if (!checker->dry_run) {
+			mark_inode_used(disk, dir_entry->inode - 1);
+		}
 	}
 }
 
@@ -82,25 +575,28 @@ void check_dir_entry_i_dtime(unsigned char *disk, struct ext2_dir_entry *dir_ent
 	struct ext2_inode *inode_entry = inode_from_index(disk, dir_entry->inode - 1);
 	
 	if (inode_entry->i_dtime) {
-		printf("Fixed: valid inode marked for deletion: [%d]\n", dir_entry->inode);
-		inode_entry->i_dtime = 0;
-		checker->total_fixes++;
+		report_finding(checker, FINDING_I_DTIME, 0, dir_entry->inode, 0, 1);
+		if (!checker->dry_run) {
+			inode_entry->i_dtime = 0;
+		}
 	}
 }
 
 
-void count_inconsistent_blocks(unsigned char *disk, unsigned int inode, unsigned int block, void *arg) {
-	int *inconsistent_blocks = (int *) arg;
+struct count_inconsistent_blocks_arg {
+	bool dry_run;
+	unsigned int inconsistent_blocks;
+};
 
-	struct ext2_super_block *s = DISK_SUPER_BLOCK(disk);
-	struct ext2_group_desc *bg = DISK_GROUP_DESC(disk);
-	unsigned char *bb = DISK_BLOCK_BITMAP(disk);
 
-	if (!is_bit_set_by_index(bb, block)) {
-		set_bit_by_index(bb, block);
-		(*inconsistent_blocks)++;
-		s->s_free_blocks_count--;
-		bg->bg_free_blocks_count--;
+void count_inconsistent_blocks(unsigned char *disk, unsigned int inode, unsigned int block, void *arg) {
+	struct count_inconsistent_blocks_arg *count = (struct count_inconsistent_blocks_arg *) arg;
+
+	if (is_block_free(disk, block)) {
+		if (!count->dry_run) {
+			mark_block_used(disk, block);
+		}
+		count->inconsistent_blocks++;
 	}
 }
 
@@ -108,42 +604,496 @@ void count_inconsistent_blocks(unsigned char *disk, unsigned int inode, unsigned
 void check_dir_entry_datablocks(unsigned char *disk, struct ext2_dir_entry *dir_entry, void *arg) {
 	struct ext2_checker_data *checker = (struct ext2_checker_data *) arg;
 
-	int inconsistent_blocks = 0;
+	struct count_inconsistent_blocks_arg count = { checker->dry_run, 0 };
 
-	inode_block_foreach(disk, dir_entry->inode, &count_inconsistent_blocks, &inconsistent_blocks);
+	inode_block_foreach(disk, dir_entry->inode - 1, &count_inconsistent_blocks, &count);
 
-	if (inconsistent_blocks) {
-		printf("Fixed: %d in-use data blocks not marked in data bitmap for inode: [%d]\n", inconsistent_blocks, dir_entry->inode);
-		checker->free_blocks -= inconsistent_blocks;
-		checker->total_fixes += inconsistent_blocks;
+	if (count.inconsistent_blocks) {
+		report_finding(checker, FINDING_DATABLOCKS, 0, dir_entry->inode, count.inconsistent_blocks, count.inconsistent_blocks);
 	}
 }
 
 
-void check_dir_entry(unsigned char *disk, struct ext2_dir_entry *dir_entry, void *arg) {
-	check_dir_entry_file_type(disk, dir_entry, arg);
-	check_dir_entry_inode(disk, dir_entry, arg);
-	check_dir_entry_i_dtime(disk, dir_entry, arg);
-	check_dir_entry_datablocks(disk, dir_entry, arg);
+#define CHECK_FILE_TYPE  0x1
+#define CHECK_INODE      0x2
+#define CHECK_I_DTIME    0x4
+#define CHECK_DATABLOCKS 0x8
+
+/**
+ * The checks that concern the inode rather than the directory entry, only needed once per inode.
+ */
+#define CHECK_INODE_ALL  (CHECK_INODE | CHECK_I_DTIME | CHECK_DATABLOCKS)
+
+
+/**
+ * Applies the checks to a directory entry, printing and fixing whatever is wrong.
+ */
+void check_dir_entry(unsigned char *disk, struct ext2_dir_entry *dir_entry, int checks, struct ext2_checker_data *checker) {
+	if (checks & CHECK_FILE_TYPE) check_dir_entry_file_type(disk, dir_entry, checker);
+	if (checks & CHECK_INODE) check_dir_entry_inode(disk, dir_entry, checker);
+	if (checks & CHECK_I_DTIME) check_dir_entry_i_dtime(disk, dir_entry, checker);
+	if (checks & CHECK_DATABLOCKS) check_dir_entry_datablocks(disk, dir_entry, checker);
+}
+
+
+void find_free_datablock(unsigned char *disk, unsigned int inode, unsigned int block, void *arg) {
+	bool *found = (bool *) arg;
+	*found = *found || is_block_free(disk, block);
+}
 
-	struct ext2_inode *inode_entry = inode_from_index(disk, dir_entry->inode - 1);
 
-	if (S_ISDIR(inode_entry->i_mode) && !is_dot_or_dot_dot(dir_entry->name, dir_entry->name_len) && !is_inode_reserved(dir_entry->inode - 1)) {
-		directory_entry_foreach(disk, dir_entry->inode - 1, &check_dir_entry_file_type, arg);
+/**
+ * Returns the checks that check_dir_entry would fix something for, without modifying the disk, so
+ * that it can run on many threads at once.
+ */
+int dir_entry_failed_checks(unsigned char *disk, struct ext2_dir_entry *dir_entry, int checks) {
+	unsigned int inode = dir_entry->inode - 1;
+	struct ext2_inode *inode_entry = inode_from_index(disk, inode);
+	int failed = 0;
+
+	if (checks & CHECK_FILE_TYPE) {
+		if (
+			(dir_entry->file_type != EXT2_FT_DIR && S_ISDIR(inode_entry->i_mode))
+			|| (dir_entry->file_type != EXT2_FT_SYMLINK && S_ISLNK(inode_entry->i_mode))
+			|| (dir_entry->file_type != EXT2_FT_REG_FILE && S_ISREG(inode_entry->i_mode))
+		) {
+			failed |= CHECK_FILE_TYPE;
+		}
+	}
+
+	if ((checks & CHECK_INODE) && !is_bit_set_by_index(DISK_INODE_BITMAP(disk, INODE_GROUP(disk, inode)), INODE_GROUP_INDEX(disk, inode))) {
+		failed |= CHECK_INODE;
 	}
+
+	if ((checks & CHECK_I_DTIME) && inode_entry->i_dtime) {
+		failed |= CHECK_I_DTIME;
+	}
+
+	if (checks & CHECK_DATABLOCKS) {
+		bool found = false;
+		inode_block_foreach(disk, inode, &find_free_datablock, &found);
+		if (found) {
+			failed |= CHECK_DATABLOCKS;
+		}
+	}
+
+	return failed;
+}
+
+
+/**
+ * A directory to scan. Scanning only reads the disk, it records in entry order the entries that
+ * need fixing and the entries that refer to directories, so that the fixes can be replayed later
+ * on a single thread in the same order as a depth first walk.
+ */
+struct dir_job {
+	unsigned int inode;
+	struct dir_job_item *items;
+	unsigned int items_len;
+	unsigned int items_cap;
+};
+
+struct dir_job_item {
+	struct ext2_dir_entry *dir_entry;
+	int checks;
+	bool is_dir;
+};
+
+
+/**
+ * Every worker owns a deque of jobs, it pushes and pops at the tail, and idle workers steal from
+ * the head of the others.
+ */
+struct dir_worker {
+	pthread_mutex_t lock;
+	struct dir_job **jobs;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int cap;
+	unsigned int id;
+	struct dir_pool *pool;
+};
+
+/**
+ * Shared by the workers, inode_state is indexed by inode and only moves forward from
+ * INODE_UNSEEN, so that every reachable inode is checked, and every directory queued, exactly once
+ * even when the tree has cycles.
+ */
+#define INODE_UNSEEN   0
+#define INODE_CHECKING 1
+#define INODE_OK       2
+#define INODE_FAILED   3
+
+struct dir_pool {
+	struct dir_worker *workers;
+	unsigned int nworkers;
+	unsigned int pending;
+	unsigned char *inode_state;
+	struct dir_job **jobs_by_inode;
+	struct ext2_checker_data *checker;
+};
+
+
+struct dir_job *new_dir_job(unsigned int inode) {
+	struct dir_job *job = calloc(1, sizeof (struct dir_job));
+	if (job == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	job->inode = inode;
+	return job;
+}
+
+
+void dir_job_add_item(struct dir_job *job, struct ext2_dir_entry *dir_entry, int checks, bool is_dir) {
+	if (job->items_len == job->items_cap) {
+		job->items_cap = job->items_cap ? job->items_cap * 2 : 8;
+		job->items = realloc(job->items, job->items_cap * sizeof (struct dir_job_item));
+		if (job->items == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	job->items[job->items_len].dir_entry = dir_entry;
+	job->items[job->items_len].checks = checks;
+	job->items[job->items_len].is_dir = is_dir;
+	job->items_len++;
+}
+
+
+void dir_worker_push(struct dir_worker *worker, struct dir_job *job) {
+	__atomic_add_fetch(&worker->pool->pending, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->tail == worker->cap) {
+		if (worker->head > 0) {
+			memmove(worker->jobs, worker->jobs + worker->head, (worker->tail - worker->head) * sizeof (struct dir_job *));
+			worker->tail -= worker->head;
+			worker->head = 0;
+		} else {
+			worker->cap = worker->cap ? worker->cap * 2 : 64;
+			worker->jobs = realloc(worker->jobs, worker->cap * sizeof (struct dir_job *));
+			if (worker->jobs == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	worker->jobs[worker->tail++] = job;
+	pthread_mutex_unlock(&worker->lock);
+}
+
+
+struct dir_job *dir_worker_pop(struct dir_worker *worker, bool steal) {
+	struct dir_job *job = NULL;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->head < worker->tail) {
+		job = steal ? worker->jobs[worker->head++] : worker->jobs[--worker->tail];
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return job;
+}
+
+
+struct scan_dir_entry_arg {
+	struct dir_worker *worker;
+	struct dir_job *job;
+	bool unchanged;
+};
+
+
+/**
+ * Returns whether the directory inode is walked into. Only the reserved inodes before the first
+ * one for files are left out, lost+found is the first one for files and is walked like any other.
+ */
+bool is_dir_scanned(unsigned char *disk, unsigned int inode) {
+	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
+	unsigned int first_ino = super_block->s_rev_level == EXT2_GOOD_OLD_REV ? EXT2_GOOD_OLD_FIRST_INO : super_block->s_first_ino;
+	return S_ISDIR(inode_from_index(disk, inode)->i_mode) && (inode == EXT2_ROOT_INO - 1 || inode + 1 >= first_ino);
+}
+
+
+/**
+ * Returns the state of the inode the directory entry refers to, after checking it and queueing it
+ * if it is a directory, when this is the first entry to get to it.
+ */
+unsigned char scan_inode(struct dir_worker *worker, struct ext2_dir_entry *dir_entry) {
+	struct dir_pool *pool = worker->pool;
+	unsigned int inode = dir_entry->inode - 1;
+	unsigned char state = INODE_UNSEEN;
+
+	if (__atomic_compare_exchange_n(&pool->inode_state[inode], &state, INODE_CHECKING, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		unsigned int table_block = inode_table_block(disk, inode);
+		if (is_bit_set_by_index(pool->checker->skip_table_blocks, table_block)) {
+			state = INODE_OK;
+		} else {
+			state = dir_entry_failed_checks(disk, dir_entry, CHECK_INODE_ALL) ? INODE_FAILED : INODE_OK;
+		}
+
+		if (is_dir_scanned(disk, inode) && pool->jobs_by_inode[inode] == NULL) {
+			struct dir_job *job = new_dir_job(inode);
+			pool->jobs_by_inode[inode] = job;
+			dir_worker_push(worker, job);
+		}
+
+		__atomic_store_n(&pool->inode_state[inode], state, __ATOMIC_SEQ_CST);
+	}
+
+	while (state == INODE_CHECKING || state == INODE_UNSEEN) {
+		sched_yield();
+		state = __atomic_load_n(&pool->inode_state[inode], __ATOMIC_SEQ_CST);
+	}
+
+	return state;
+}
+
+
+void scan_dir_entry(unsigned char *disk, struct ext2_dir_entry *dir_entry, void *arg) {
+	struct scan_dir_entry_arg *scan = (struct scan_dir_entry_arg *) arg;
+
+	if (dir_entry->inode == 0 || dir_entry->inode > DISK_SUPER_BLOCK(disk)->s_inodes_count) {
+		return;
+	}
+
+	// An entry of an unchanged directory that refers to an unchanged inode was consistent at the
+	// checkpoint, so it only matters for the directories it leads to.
+	if (scan->unchanged && is_bit_set_by_index(scan->worker->pool->checker->skip_table_blocks, inode_table_block(disk, dir_entry->inode - 1))) {
+		if (dir_entry->file_type == EXT2_FT_DIR && is_dir_scanned(disk, dir_entry->inode - 1)) {
+			scan_inode(scan->worker, dir_entry);
+			dir_job_add_item(scan->job, dir_entry, 0, true);
+		}
+		return;
+	}
+
+	int checks = dir_entry_failed_checks(disk, dir_entry, CHECK_FILE_TYPE);
+	if (scan_inode(scan->worker, dir_entry) == INODE_FAILED) {
+		checks |= CHECK_INODE_ALL;
+	}
+
+	bool is_dir = is_dir_scanned(disk, dir_entry->inode - 1);
+
+	if (checks || is_dir) {
+		dir_job_add_item(scan->job, dir_entry, checks, is_dir);
+	}
+}
+
+
+void *dir_worker_run(void *arg) {
+	struct dir_worker *worker = (struct dir_worker *) arg;
+	struct dir_pool *pool = worker->pool;
+
+	for (;;) {
+		struct dir_job *job = dir_worker_pop(worker, false);
+		for (unsigned int i = 1; job == NULL && i < pool->nworkers; i++) {
+			job = dir_worker_pop(&pool->workers[(worker->id + i) % pool->nworkers], true);
+		}
+
+		if (job != NULL) {
+			bool unchanged = is_bit_set_by_index(pool->checker->skip_dir_blocks, inode_table_block(disk, job->inode));
+			struct scan_dir_entry_arg scan = { worker, job, unchanged };
+			directory_entry_foreach(disk, job->inode, &scan_dir_entry, &scan);
+			__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+		} else if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0) {
+			return NULL;
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+
+/**
+ * Scans every directory reachable from the root with nworkers threads, then applies the fixes
+ * found on this thread in depth first order, so the output does not depend on how the work was
+ * split.
+ * 
+ * The inode checks of an inode are only replayed at its first entry in that order.
+ */
+void check_dir_tree(unsigned int nworkers, struct ext2_checker_data *checker) {
+	unsigned int inodes = DISK_SUPER_BLOCK(disk)->s_inodes_count;
+	unsigned int root = EXT2_ROOT_INO - 1;
+
+	struct dir_pool pool;
+	pool.nworkers = nworkers;
+	pool.pending = 0;
+	pool.checker = checker;
+	pool.workers = calloc(nworkers, sizeof (struct dir_worker));
+	pool.inode_state = calloc(inodes, sizeof (unsigned char));
+	pool.jobs_by_inode = calloc(inodes, sizeof (struct dir_job *));
+	pthread_t *threads = calloc(nworkers, sizeof (pthread_t));
+	if (pool.workers == NULL || pool.inode_state == NULL || pool.jobs_by_inode == NULL || threads == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (unsigned int i = 0; i < nworkers; i++) {
+		pthread_mutex_init(&pool.workers[i].lock, NULL);
+		pool.workers[i].id = i;
+		pool.workers[i].pool = &pool;
+	}
+
+	// The root is only checked through its own "." entry, like any other directory.
+	pool.jobs_by_inode[root] = new_dir_job(root);
+	dir_worker_push(&pool.workers[0], pool.jobs_by_inode[root]);
+	for (unsigned int i = 1; i < nworkers; i++) {
+		if (pthread_create(&threads[i], NULL, &dir_worker_run, &pool.workers[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	dir_worker_run(&pool.workers[0]);
+	for (unsigned int i = 1; i < nworkers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (unsigned int i = 0; i < nworkers; i++) {
+		pthread_mutex_destroy(&pool.workers[i].lock);
+		free(pool.workers[i].jobs);
+	}
+	free(pool.workers);
+	free(pool.inode_state);
+	free(threads);
+
+	// Replay with an explicit stack of (job, next item) pairs, and a bitmap of the directories
+	// already replayed.
+	unsigned char *replayed = calloc((inodes + 7) / 8, sizeof (unsigned char));
+	unsigned char *checked = calloc((inodes + 7) / 8, sizeof (unsigned char));
+	struct dir_job **stack = NULL;
+	unsigned int *next = NULL;
+	unsigned int depth = 0, cap = 0;
+	if (replayed == NULL || checked == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	struct dir_job *job = pool.jobs_by_inode[root];
+	unsigned int item = 0;
+	set_bit_by_index(replayed, root);
+	for (;;) {
+		if (item < job->items_len) {
+			struct dir_job_item *current = &job->items[item++];
+			unsigned int child = current->dir_entry->inode - 1;
+
+			int checks = current->checks;
+			if (checks & CHECK_INODE_ALL) {
+				if (is_bit_set_by_index(checked, child)) {
+					checks &= ~CHECK_INODE_ALL;
+				}
+				set_bit_by_index(checked, child);
+			}
+			check_dir_entry(disk, current->dir_entry, checks, checker);
+
+			if (current->is_dir && !is_bit_set_by_index(replayed, child)) {
+				set_bit_by_index(replayed, child);
+				if (depth == cap) {
+					cap = cap ? cap * 2 : 16;
+					stack = realloc(stack, cap * sizeof (struct dir_job *));
+					next = realloc(next, cap * sizeof (unsigned int));
+					if (stack == NULL || next == NULL) {
+						perror("realloc");
+						exit(EXIT_FAILURE);
+					}
+				}
+				stack[depth] = job;
+				next[depth] = item;
+				depth++;
+				job = pool.jobs_by_inode[child];
+				item = 0;
+			}
+		} else if (depth > 0) {
+			depth--;
+			job = stack[depth];
+			item = next[depth];
+		} else {
+			break;
+		}
+	}
+
+	for (unsigned int inode = 0; inode < inodes; inode++) {
+		if (pool.jobs_by_inode[inode] != NULL) {
+			free(pool.jobs_by_inode[inode]->items);
+			free(pool.jobs_by_inode[inode]);
+		}
+	}
+	free(pool.jobs_by_inode);
+	free(replayed);
+	free(checked);
+	free(stack);
+	free(next);
 }
 
 
 int main(int argc, char **argv) {
-	if (argc != 2) {
+	unsigned int nworkers = 1;
+	bool dry_run = false;
+	bool incremental = false;
+	char *checkpoint_path = NULL;
+	enum report_format format = FORMAT_TEXT;
+	int opt;
+
+	struct option long_options[] = {
+		{ "dry-run", no_argument, NULL, 'n' },
+		{ "format", required_argument, NULL, 'f' },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "incremental", no_argument, NULL, 'i' },
+		{ "checkpoint", required_argument, NULL, 'c' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, "j:n", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'n':
+				dry_run = true;
+				break;
+
+			case 'i':
+				incremental = true;
+				break;
+
+			case 'c':
+				checkpoint_path = optarg;
+				break;
+
+			case 'f':
+				if (strcmp(optarg, "text") == 0) {
+					format = FORMAT_TEXT;
+				} else if (strcmp(optarg, "json") == 0) {
+					format = FORMAT_JSON;
+				} else if (strcmp(optarg, "binary") == 0) {
+					format = FORMAT_BINARY;
+				} else {
+					usage(get_filename(argv[0]));
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'j':
+				nworkers = strtoul(optarg, NULL, 10);
+				if (nworkers == 0) {
+					usage(get_filename(argv[0]));
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			default:
+				usage(get_filename(argv[0]));
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind != 1) {
 		usage(get_filename(argv[0]));
 		exit(EXIT_FAILURE);
 	}
 
-	disk = load_disk(argv[1]);
+	// A dry run maps the image read-only, so it also works on read-only media and snapshots. A full
+	// check reads every bitmap, inode table, and directory, so the mapping is prefaulted up front.
+	disk = load_disk(argv[optind], (dry_run ? LOAD_DISK_READ_ONLY : 0) | (incremental ? 0 : LOAD_DISK_POPULATE));
 
 	struct ext2_super_block *s = DISK_SUPER_BLOCK(disk);
-	struct ext2_group_desc *bg = DISK_GROUP_DESC(disk);
+	unsigned int groups = DISK_GROUP_COUNT(disk);
 
 	struct ext2_checker_data *checker = malloc(sizeof (struct ext2_checker_data));
 	if (checker == NULL) {
@@ -153,42 +1103,116 @@ int main(int argc, char **argv) {
 	checker->free_inodes = 0;
 	checker->free_blocks = 0;
 	checker->total_fixes = 0;
+	checker->dry_run = dry_run;
+	checker->format = format;
+	checker->findings = NULL;
+	checker->findings_len = 0;
+	checker->findings_cap = 0;
+	checker->group_free_inodes = calloc(groups, sizeof (unsigned int));
+	checker->group_free_blocks = calloc(groups, sizeof (unsigned int));
+	if (checker->group_free_inodes == NULL || checker->group_free_blocks == NULL) {
+		perror(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned int table_blocks = groups * inode_table_blocks(disk);
+	checker->current.groups = calloc(groups, sizeof (struct checkpoint_group));
+	checker->current.table_blocks = calloc(table_blocks, sizeof (struct checkpoint_table_block));
+	checker->skip_table_blocks = calloc((table_blocks + 7) / 8, sizeof (unsigned char));
+	checker->skip_dir_blocks = calloc((table_blocks + 7) / 8, sizeof (unsigned char));
+	if (checker->current.groups == NULL || checker->current.table_blocks == NULL || checker->skip_table_blocks == NULL || checker->skip_dir_blocks == NULL) {
+		perror(argv[0]);
+		exit(EXIT_FAILURE);
+	}
 
-	inode_foreach(disk, &check_inode_bit, (void *) checker);
-	block_foreach(disk, &check_block_bit, (void *) checker);
+	if (incremental && checkpoint_path == NULL) {
+		checkpoint_path = malloc(strlen(argv[optind]) + sizeof ".ckpt");
+		if (checkpoint_path == NULL) {
+			perror(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		sprintf(checkpoint_path, "%s.ckpt", argv[optind]);
+	}
+	checker->previous = incremental ? load_checkpoint(checkpoint_path) : NULL;
+
+	// Each thread counts its own stripe of groups, the totals are summed in group order after.
+	unsigned int nthreads = MIN(nworkers, groups);
+	run_group_stripes(checker, nthreads, &count_groups);
+
+	if (checker->previous != NULL) {
+		compare_checkpoint(checker);
+	}
+
+	for (unsigned int group = 0; group < groups; group++) {
+		checker->free_inodes += checker->group_free_inodes[group];
+		checker->free_blocks += checker->group_free_blocks[group];
+	}
 
 	if (s->s_free_inodes_count != checker->free_inodes) {
 		unsigned int fixes = unsigned_abs_diff(s->s_free_inodes_count, checker->free_inodes);
-		printf("Fixed: superblock's free inodes counter was off by %d compared to the bitmap\n", fixes);
-		s->s_free_inodes_count = checker->free_inodes;
-		checker->total_fixes++;
+		report_finding(checker, FINDING_SUPER_FREE_INODES, 0, 0, fixes, 1);
+		if (!dry_run) {
+			s->s_free_inodes_count = checker->free_inodes;
+		}
 	}
 
 	if (s->s_free_blocks_count != checker->free_blocks) {
 		unsigned int fixes = unsigned_abs_diff(s->s_free_blocks_count, checker->free_blocks);
-		printf("Fixed: superblock's free blocks counter was off by %d compared to the bitmap\n", fixes);
-		s->s_free_blocks_count = checker->free_blocks;
-		checker->total_fixes++;
+		report_finding(checker, FINDING_SUPER_FREE_BLOCKS, 0, 0, fixes, 1);
+		if (!dry_run) {
+			s->s_free_blocks_count = checker->free_blocks;
+		}
 	}
 
-	if (bg->bg_free_inodes_count != checker->free_inodes) {
-		unsigned int fixes = unsigned_abs_diff(bg->bg_free_inodes_count, checker->free_inodes);
-		printf("Fixed: block group's free inodes counter was off by %d compared to the bitmap\n", fixes);
-		bg->bg_free_inodes_count = checker->free_inodes;
-		checker->total_fixes++;
-	}
+	for (unsigned int group = 0; group < groups; group++) {
+		struct ext2_group_desc *bg = DISK_GROUP_DESC(disk, group);
+
+		if (bg->bg_free_inodes_count != checker->group_free_inodes[group]) {
+			unsigned int fixes = unsigned_abs_diff(bg->bg_free_inodes_count, checker->group_free_inodes[group]);
+			report_finding(checker, FINDING_GROUP_FREE_INODES, group, 0, fixes, 1);
+			if (!dry_run) {
+				bg->bg_free_inodes_count = checker->group_free_inodes[group];
+			}
+		}
 
-	if (bg->bg_free_blocks_count != checker->free_blocks) {
-		unsigned int fixes = unsigned_abs_diff(bg->bg_free_blocks_count, checker->free_blocks);
-		printf("Fixed: block group's free blocks counter was off by %d compared to the bitmap\n", fixes);
-		bg->bg_free_blocks_count = checker->free_blocks;
-		checker->total_fixes++;
+		if (bg->bg_free_blocks_count != checker->group_free_blocks[group]) {
+			unsigned int fixes = unsigned_abs_diff(bg->bg_free_blocks_count, checker->group_free_blocks[group]);
+			report_finding(checker, FINDING_GROUP_FREE_BLOCKS, group, 0, fixes, 1);
+			if (!dry_run) {
+				bg->bg_free_blocks_count = checker->group_free_blocks[group];
+			}
+		}
 	}
 
-	directory_entry_foreach(disk, EXT2_ROOT_INO - 1, &check_dir_entry, (void *) checker);
+	check_dir_tree(nworkers, checker);
+
+	// Only a run that fixed everything it found leaves a checkpoint worth trusting.
+	if (incremental && !dry_run) {
+		if (checker->total_fixes) {
+			run_group_stripes(checker, nthreads, &count_groups);
+		}
+		run_group_stripes(checker, nthreads, &record_group_masks);
+
+		struct checkpoint_header *header = &checker->current.header;
+		memcpy(header->magic, CHECKPOINT_MAGIC, 4);
+		header->version = CHECKPOINT_VERSION;
+		header->block_size = DISK_BLOCK_SIZE(disk);
+		header->blocks_count = s->s_blocks_count;
+		header->inodes_count = s->s_inodes_count;
+		header->groups = groups;
+		header->table_blocks = inode_table_blocks(disk);
+
+		if (save_checkpoint(checkpoint_path, &checker->current) == -1) {
+			fprintf(stderr, "%s: %s: %s\n", get_filename(argv[0]), checkpoint_path, strerror(errno));
+		}
+	}
 
-	if (checker->total_fixes) {
-		printf("%d file system inconsistencies repaired!\n", checker->total_fixes);
+	if (format == FORMAT_JSON) {
+		print_report_json(checker);
+	} else if (format == FORMAT_BINARY) {
+		print_report_binary(checker);
+	} else if (checker->total_fixes) {
+		printf("%d file system inconsistencies %s!\n", checker->total_fixes, dry_run ? "found" : "repaired");
 	} else {
 		printf("No file system inconsistencies detected!\n");
 	}
@@ -0,0 +1,1095 @@
+/**
+ * Copyright (C) 2019
+ * Omar Chehab (omarchehab98@gmail.com)
+ * University of Toronto
+ */
+#include <dirent.h>
+#include <pthread.h>
+#include "ext2_commands.h"
+
+
+int ext2_mkdir(char *program, unsigned char *disk, char *abspath) {
+	if (!is_abs_path(abspath)) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EINVAL));
+		return -1;
+	}
+
+	trim_trailing_slash(abspath);
+	char *path = get_filepath(abspath);
+	char *name = get_filename(abspath);
+
+	unsigned int parent_inode = inode_by_filepath(disk, path);
+	if (parent_inode == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, path, strerror(ENOENT));
+		return -1;
+	}
+
+	struct ext2_inode *parent_inode_entry = inode_from_index(disk, parent_inode);
+	if (!S_ISDIR(parent_inode_entry->i_mode)) {
+		fprintf(stderr, "%s: %s: %s\n", program, path, strerror(ENOTDIR));
+		return -1;
+	}
+
+	unsigned int file_inode = inode_by_filepath(disk, abspath);
+	if (file_inode != -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EEXIST));
+		return -1;
+	}
+
+	unsigned int child_inode = new_inode_dir(disk);
+	if (child_inode == -1) {
+		perror(program);
+		return -1;
+	}
+
+	struct ext2_group_desc *bg = DISK_GROUP_DESC(disk, INODE_GROUP(disk, child_inode));
+	bg->bg_used_dirs_count++;
+
+	struct ext2_dir_entry* dir = new_dir_entry(disk, parent_inode, child_inode, name, EXT2_FT_DIR);
+	if (dir == NULL) {
+		// TODO: delete child_inode
+		perror(program);
+		return -1;
+	}
+
+	struct new_dir_entry_item dots[] = {
+		{ ".", child_inode, EXT2_FT_DIR, NULL },
+		{ "..", parent_inode, EXT2_FT_DIR, NULL },
+	};
+	if (new_dir_entries(disk, child_inode, dots, 2) == -1) {
+		// TODO: delete child_inode, dir, and any dot entry
+		perror(program);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int ext2_cp(char *program, unsigned char *disk, char *source_path, char *abspath) {
+	if (!is_abs_path(abspath)) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EINVAL));
+		return -1;
+	}
+
+	char *source_name = get_filename(source_path);
+	trim_trailing_slash(abspath);
+	char *dest_path = get_filepath(abspath);
+	char *dest_name = get_filename(abspath);
+
+	unsigned int dest_inode = inode_by_filepath(disk, dest_path);
+	if (dest_inode == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, dest_path, strerror(ENOENT));
+		return -1;
+	}
+
+	unsigned int dest_file_inode = inode_by_filepath(disk, abspath);
+	if (dest_file_inode != -1) {
+		struct ext2_inode *dest_file_inode_entry = inode_from_index(disk, dest_file_inode);
+		if (S_ISDIR(dest_file_inode_entry->i_mode)) {
+			dest_path = path_join(dest_path, dest_name);
+			dest_name = source_name;
+			dest_inode = inode_by_filepath(disk, dest_path);
+		} else {
+			fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EEXIST));
+			return -1;
+		}
+	}
+
+	if (strlen(dest_name) > EXT2_NAME_LEN) {
+		fprintf(stderr, "%s: %s: %s\n", program, dest_name, strerror(ENAMETOOLONG));
+		return -1;
+	}
+
+	struct ext2_inode *dest_inode_entry = inode_from_index(disk, dest_inode);
+	if (!S_ISDIR(dest_inode_entry->i_mode)) {
+		fprintf(stderr, "%s: %s: %s\n", program, dest_path, strerror(ENOTDIR));
+		return -1;
+	}
+
+	int source_fd = open(source_path, O_RDONLY);
+	struct stat source_stat;
+	if (source_fd == -1 || fstat(source_fd, &source_stat) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, source_path, strerror(errno));
+		if (source_fd != -1) close(source_fd);
+		return -1;
+	}
+
+	if (S_ISDIR(source_stat.st_mode) || source_stat.st_size > UINT32_MAX) {
+		fprintf(stderr, "%s: %s: %s\n", program, source_path, strerror(S_ISDIR(source_stat.st_mode) ? EISDIR : EFBIG));
+		close(source_fd);
+		return -1;
+	}
+
+	unsigned int file_inode = new_inode_file(disk);
+	if (file_inode == -1) {
+		perror(program);
+		close(source_fd);
+		return -1;
+	}
+
+	struct ext2_dir_entry* file_dir_entry = new_dir_entry(disk, dest_inode, file_inode, dest_name, EXT2_FT_REG_FILE);
+	if (file_dir_entry == NULL) {
+		// TODO: cleanup file_inode
+		perror(program);
+		close(source_fd);
+		return -1;
+	}
+
+	if (write_file_to_blocks(disk, file_dir_entry, source_fd, source_stat.st_size) == NULL) {
+		// TODO: cleanup file_inode, file_dir_entry
+		perror(program);
+		close(source_fd);
+		return -1;
+	}
+
+	close(source_fd);
+	return 0;
+}
+
+
+/**
+ * ext2_cp -r walks the host tree and allocates every inode, directory entry, and block on the
+ * calling thread, the committer, which is the only one to touch the metadata of the image. Each
+ * run of datablocks it allocates for a file is queued as a read from the host file straight into
+ * the mapped image, and the reads are done by a pool of threads.
+ */
+#define CP_QUEUE_SIZE 1024
+#define CP_MAX_OPEN_FILES 256
+
+struct cp_pool;
+
+struct cp_file {
+	struct cp_pool *pool;
+	int fd;
+	char *path;
+	unsigned int refs;  /* Reads queued, plus one while the committer is still queueing */
+};
+
+struct cp_read {
+	struct cp_file *file;
+	unsigned char *destination;
+	size_t len;
+	off_t offset;
+};
+
+struct cp_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct cp_read reads[CP_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int len;
+	unsigned int open_files;
+	bool done;
+	bool failed;
+	char *program;
+	unsigned char *disk;
+};
+
+
+/**
+ * Drops a reference to the file, the last one closes it. Called with the pool locked.
+ */
+void cp_file_release(struct cp_pool *pool, struct cp_file *file) {
+	if (--file->refs == 0) {
+		if (file->fd != -1) {
+			close(file->fd);
+		}
+		free(file->path);
+		free(file);
+		pool->open_files--;
+	}
+	// Wakes the committer when it waits for the open files to drop, or for the reads of a file.
+	pthread_cond_broadcast(&pool->not_full);
+}
+
+
+void *cp_worker(void *arg) {
+	struct cp_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (pool->len == 0 && !pool->done) {
+			pthread_cond_wait(&pool->not_empty, &pool->lock);
+		}
+		if (pool->len == 0) {
+			break;
+		}
+
+		struct cp_read read = pool->reads[pool->head];
+		pool->head = (pool->head + 1) % CP_QUEUE_SIZE;
+		pool->len--;
+		pthread_cond_broadcast(&pool->not_full);
+		pthread_mutex_unlock(&pool->lock);
+
+		bool ok = pread_to_disk(read.file->fd, read.destination, read.len, read.offset);
+		int error = errno;
+
+		pthread_mutex_lock(&pool->lock);
+		if (!ok) {
+			fprintf(stderr, "%s: %s: %s\n", pool->program, read.file->path, strerror(error));
+			pool->failed = true;
+		}
+		cp_file_release(pool, read.file);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+
+/**
+ * Sets that the copy failed, for the exit status.
+ */
+void cp_fail(struct cp_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->failed = true;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+ * Waits until the reads queued for every file are done, so that the blocks they go into can be
+ * freed. Called from the directory walk, which is the only one to open files.
+ */
+void cp_drain(struct cp_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->open_files > 0) {
+		pthread_cond_wait(&pool->not_full, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+ * Frees an inode that was allocated for the copy but could not be linked into the tree, with its
+ * blocks. A directory that has its "." and ".." also gives back the link they made to its parent.
+ */
+void cp_tree_rm_inode(struct cp_pool *pool, unsigned int inode, unsigned int parent_inode) {
+	struct ext2_inode *inode_entry = inode_from_index(pool->disk, inode);
+
+	if (S_ISDIR(inode_entry->i_mode)) {
+		if (inode_entry->i_links_count > 0) {
+			inode_from_index(pool->disk, parent_inode)->i_links_count--;
+			dentry_cache_insert(inode, ".", -1);
+			dentry_cache_insert(inode, "..", -1);
+		}
+		dir_free_space_forget(inode);
+		DISK_GROUP_DESC(pool->disk, INODE_GROUP(pool->disk, inode))->bg_used_dirs_count--;
+	}
+
+	rm_inode_blocks(pool->disk, inode);
+	rm_inode(pool->disk, inode);
+	inode_entry->i_links_count = 0;
+	inode_entry->i_dtime = time(NULL);
+}
+
+
+bool cp_queue_read(unsigned char *destination, size_t len, off_t offset, void *arg) {
+	struct cp_file *file = arg;
+	struct cp_pool *pool = file->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->len == CP_QUEUE_SIZE) {
+		pthread_cond_wait(&pool->not_full, &pool->lock);
+	}
+	struct cp_read *slot = &pool->reads[(pool->head + pool->len) % CP_QUEUE_SIZE];
+	slot->file = file;
+	slot->destination = destination;
+	slot->len = len;
+	slot->offset = offset;
+	file->refs++;
+	pool->len++;
+	pthread_cond_signal(&pool->not_empty);
+	pthread_mutex_unlock(&pool->lock);
+
+	return true;
+}
+
+
+/**
+ * Creates an inode for the regular host file at path and queues the reads of its contents, returns
+ * the inode or -1 on failure. If the inode or its blocks could not be allocated, anything that was
+ * allocated for it is freed again and status is set to -1, since the copy cannot go on.
+ */
+unsigned int cp_tree_file(struct cp_pool *pool, char *path, int *status) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->open_files == CP_MAX_OPEN_FILES) {
+		pthread_cond_wait(&pool->not_full, &pool->lock);
+	}
+	pool->open_files++;
+	pthread_mutex_unlock(&pool->lock);
+
+	struct cp_file *file = malloc(sizeof (struct cp_file));
+	if (file == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	file->pool = pool;
+	file->path = path;
+	file->refs = 1;
+	file->fd = open(path, O_RDONLY);
+
+	unsigned int inode = -1;
+	struct stat stat;
+	if (file->fd == -1 || fstat(file->fd, &stat) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", pool->program, path, strerror(errno));
+	} else if (stat.st_size > UINT32_MAX) {
+		fprintf(stderr, "%s: %s: %s\n", pool->program, path, strerror(EFBIG));
+	} else if ((inode = new_inode_file(pool->disk)) == -1) {
+		perror(pool->program);
+		*status = -1;
+	} else if (inode_alloc_blocks(pool->disk, inode, stat.st_size, &cp_queue_read, file) == -1) {
+		perror(pool->program);
+		*status = -1;
+
+		// The reads already queued go into the blocks that are about to be freed, so they have to
+		// be done first, otherwise they could land in another file's blocks.
+		pthread_mutex_lock(&pool->lock);
+		while (file->refs > 1) {
+			pthread_cond_wait(&pool->not_full, &pool->lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		cp_tree_rm_inode(pool, inode, -1);
+		inode = -1;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (inode == -1) {
+		pool->failed = true;
+	}
+	cp_file_release(pool, file);
+	pthread_mutex_unlock(&pool->lock);
+
+	return inode;
+}
+
+
+/**
+ * Creates an inode for a host directory, with its "." and ".." entries so that it is whole before
+ * it is linked into parent_inode. Returns the inode, or -1 on failure and status is set to -1.
+ */
+unsigned int cp_tree_dir(struct cp_pool *pool, unsigned int parent_inode, int *status) {
+	unsigned int inode = new_inode_dir(pool->disk);
+	if (inode == -1) {
+		perror(pool->program);
+		*status = -1;
+		return -1;
+	}
+	DISK_GROUP_DESC(pool->disk, INODE_GROUP(pool->disk, inode))->bg_used_dirs_count++;
+
+	struct new_dir_entry_item dots[] = {
+		{ ".", inode, EXT2_FT_DIR, NULL },
+		{ "..", parent_inode, EXT2_FT_DIR, NULL },
+	};
+	if (new_dir_entries(pool->disk, inode, dots, 2) == -1) {
+		perror(pool->program);
+		*status = -1;
+		cp_tree_rm_inode(pool, inode, parent_inode);
+		return -1;
+	}
+
+	return inode;
+}
+
+
+/**
+ * Copies everything in the host directory at path into the directory inode on the disk, the
+ * entries of each directory are inserted together. Returns -1 if the copy had to stop.
+ */
+int cp_tree(struct cp_pool *pool, char *path, unsigned int dir_inode) {
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		fprintf(stderr, "%s: %s: %s\n", pool->program, path, strerror(errno));
+		cp_fail(pool);
+		return 0;
+	}
+
+	struct new_dir_entry_item *items = NULL;
+	char **item_paths = NULL;
+	unsigned int count = 0;
+	unsigned int size = 0;
+	int status = 0;
+
+	struct dirent *host_entry;
+	while ((host_entry = readdir(dir)) != NULL) {
+		char *name = host_entry->d_name;
+		if (is_dot_or_dot_dot(name, strlen(name))) {
+			continue;
+		}
+
+		char *child_path = path_join(path, name);
+		struct stat stat;
+		unsigned int inode = -1;
+		unsigned char file_type = EXT2_FT_UNKNOWN;
+
+		if (strlen(name) > EXT2_NAME_LEN) {
+			fprintf(stderr, "%s: %s: %s\n", pool->program, child_path, strerror(ENAMETOOLONG));
+		} else if (lstat(child_path, &stat) == -1) {
+			fprintf(stderr, "%s: %s: %s\n", pool->program, child_path, strerror(errno));
+		} else if (S_ISDIR(stat.st_mode)) {
+			inode = cp_tree_dir(pool, dir_inode, &status);
+			file_type = EXT2_FT_DIR;
+		} else if (S_ISREG(stat.st_mode)) {
+			inode = cp_tree_file(pool, child_path, &status);
+			file_type = EXT2_FT_REG_FILE;
+			child_path = NULL;
+		} else {
+			fprintf(stderr, "%s: %s: %s\n", pool->program, child_path, strerror(ENOTSUP));
+		}
+
+		if (inode == -1) {
+			cp_fail(pool);
+			free(child_path);
+			if (status == -1) {
+				break;
+			}
+			continue;
+		}
+
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			items = realloc(items, size * sizeof (struct new_dir_entry_item));
+			item_paths = realloc(item_paths, size * sizeof (char *));
+			if (items == NULL || item_paths == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		items[count].name = strdup(name);
+		items[count].inode = inode;
+		items[count].file_type = file_type;
+		item_paths[count] = child_path;
+		if (items[count].name == NULL) {
+			perror("strdup");
+			exit(EXIT_FAILURE);
+		}
+		count++;
+	}
+	closedir(dir);
+
+	if (count > 0 && new_dir_entries(pool->disk, dir_inode, items, count) == -1) {
+		perror(pool->program);
+		status = -1;
+
+		// The items that did not make it into the directory are freed, once the reads into the
+		// blocks of the files among them are done.
+		cp_drain(pool);
+		for (unsigned int i = 0; i < count; i++) {
+			if (items[i].dir_entry == NULL) {
+				cp_tree_rm_inode(pool, items[i].inode, dir_inode);
+			}
+		}
+	}
+	dir_prealloc_forget(dir_inode);
+
+	// The directories are already whole, so the ones that are not copied into stay empty.
+	for (unsigned int i = 0; i < count; i++) {
+		if (status == 0 && items[i].file_type == EXT2_FT_DIR) {
+			status = cp_tree(pool, item_paths[i], items[i].inode);
+		}
+		free(items[i].name);
+		free(item_paths[i]);
+	}
+	free(items);
+	free(item_paths);
+
+	if (status == -1) {
+		cp_fail(pool);
+	}
+	return status;
+}
+
+
+int ext2_cp_recursive(char *program, unsigned char *disk, char *source_path, char *abspath, unsigned int nthreads) {
+	struct stat source_stat;
+	if (stat(source_path, &source_stat) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, source_path, strerror(errno));
+		return -1;
+	}
+	if (!S_ISDIR(source_stat.st_mode)) {
+		return ext2_cp(program, disk, source_path, abspath);
+	}
+
+	if (!is_abs_path(abspath)) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EINVAL));
+		return -1;
+	}
+
+	// Like cp -r, copying into an existing directory creates the source directory inside it.
+	trim_trailing_slash(source_path);
+	trim_trailing_slash(abspath);
+	unsigned int dest_inode = inode_by_filepath(disk, abspath);
+	if (dest_inode != -1 && S_ISDIR(inode_from_index(disk, dest_inode)->i_mode)) {
+		abspath = path_join(strcmp(abspath, "/") == 0 ? "" : abspath, get_filename(source_path));
+	}
+
+	if (ext2_mkdir(program, disk, abspath) == -1) {
+		return -1;
+	}
+	dest_inode = inode_by_filepath(disk, abspath);
+
+	struct cp_pool *pool = malloc(sizeof (struct cp_pool));
+	if (pool == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->not_empty, NULL);
+	pthread_cond_init(&pool->not_full, NULL);
+	pool->head = 0;
+	pool->len = 0;
+	pool->open_files = 0;
+	pool->done = false;
+	pool->failed = false;
+	pool->program = program;
+	pool->disk = disk;
+
+	pthread_t *threads = calloc(nthreads, sizeof (pthread_t));
+	if (threads == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned int i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, &cp_worker, pool) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	cp_tree(pool, source_path, dest_inode);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->done = true;
+	pthread_cond_broadcast(&pool->not_empty);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	bool failed = pool->failed;
+	free(threads);
+	free(pool);
+	return failed ? -1 : 0;
+}
+
+
+int ext2_ln(char *program, unsigned char *disk, char *source_path, char *abspath, bool symbolic) {
+	if (!is_abs_path(source_path)) {
+		fprintf(stderr, "%s: %s: %s\n", program, source_path, strerror(EINVAL));
+		return -1;
+	}
+
+	if (!is_abs_path(abspath)) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EINVAL));
+		return -1;
+	}
+
+	char *dest_path = get_filepath(abspath);
+	char *dest_name = get_filename(abspath);
+	if (strlen(dest_name) > EXT2_NAME_LEN) {
+		fprintf(stderr, "%s: %s: %s\n", program, dest_name, strerror(ENAMETOOLONG));
+		return -1;
+	}
+
+	unsigned int source_inode = inode_by_filepath(disk, source_path);
+	if (source_inode == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, source_path, strerror(ENOENT));
+		return -1;
+	}
+
+	unsigned int dest_path_inode = inode_by_filepath(disk, dest_path);
+	if (dest_path_inode == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, dest_path, strerror(ENOENT));
+		return -1;
+	}
+
+	// TODO: can improve efficiency by using dest_path_inode to check if dest_name exists
+	if (inode_by_filepath(disk, abspath) != -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EEXIST));
+		return -1;
+	}
+
+	struct ext2_inode *source_inode_entry = inode_from_index(disk, source_inode);
+	if (S_ISDIR(source_inode_entry->i_mode)) {
+		fprintf(stderr, "%s: %s: %s\n", program, source_path, strerror(EISDIR));
+		return -1;
+	}
+
+	if (!symbolic) {
+		struct ext2_dir_entry *link_dir_entry = new_dir_entry(disk, dest_path_inode, source_inode, dest_name, EXT2_FT_REG_FILE);
+		if (link_dir_entry == NULL) {
+			perror(program);
+			return -1;
+		}
+	} else {
+		unsigned int link_inode = new_inode_link(disk);
+		struct ext2_dir_entry *link_dir_entry = new_dir_entry(disk, dest_path_inode, link_inode, dest_name, EXT2_FT_SYMLINK);
+		if (link_dir_entry == NULL) {
+			perror(program);
+			return -1;
+		}
+
+		if (write_string_to_blocks(disk, link_dir_entry, source_path) == NULL) {
+			perror(program);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+int ext2_rm(char *program, unsigned char *disk, char *abspath) {
+	if (!is_abs_path(abspath)) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EINVAL));
+		return -1;
+	}
+
+	char *path = get_filepath(abspath);
+	char *name = get_filename(abspath);
+
+	unsigned int file_inode = inode_by_filepath(disk, abspath);
+	if (file_inode == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(ENOENT));
+		return -1;
+	}
+
+	struct ext2_inode *file_inode_entry = inode_from_index(disk, file_inode);
+	if (S_ISDIR(file_inode_entry->i_mode)) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EISDIR));
+		return -1;
+	}
+
+	unsigned int path_inode = inode_by_filepath(disk, path);
+	if (path_inode == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, path, strerror(ENOENT));
+		return -1;
+	}
+
+	if (rm_dir_entry(disk, path_inode, name) == NULL) {
+		perror(program);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+struct restore_dir_entry_data {
+	char *name;
+	unsigned char name_len;
+	bool done;
+	struct ext2_dir_entry *dir_entry;
+};
+
+
+void datablock_is_ok(unsigned char *disk, unsigned int inode, unsigned int block, void *arg) {
+	bool *datablocksOk = (bool *) arg;
+
+	if (!is_block_free(disk, block)) {
+		*datablocksOk = false;
+	}
+}
+
+void set_datablock_in_bitmap(unsigned char *disk, unsigned int inode, unsigned int block, void *arg) {
+	mark_block_used(disk, block);
+}
+
+
+void restore_dir_entry_helper(unsigned char *disk, struct ext2_dir_entry *dir_entry, void *arg) {
+	struct restore_dir_entry_data *data = (struct restore_dir_entry_data *) arg;
+
+	unsigned int min_dir_entry_size = rec_len_boundary(sizeof(struct ext2_dir_entry) + 1);
+
+	if (!data->done) {
+		unsigned int dir_entry_size = rec_len_boundary(sizeof(struct ext2_dir_entry) + dir_entry->name_len);
+		unsigned int padding = dir_entry->rec_len - dir_entry_size;
+
+		while (min_dir_entry_size <= padding) {
+			struct ext2_dir_entry *deleted_dir_entry = (struct ext2_dir_entry *)((void *) dir_entry + dir_entry_size);
+
+			if (deleted_dir_entry->inode) {
+				if (
+					is_inode_free(disk, deleted_dir_entry->inode - 1)
+					&& data->name_len == deleted_dir_entry->name_len
+					&& strncmp(data->name, deleted_dir_entry->name, deleted_dir_entry->name_len) == 0
+				) {
+					bool datablocksOk = true;
+
+					inode_block_foreach(disk, deleted_dir_entry->inode - 1, &datablock_is_ok, &datablocksOk);
+					inode_indirect_block_foreach(disk, deleted_dir_entry->inode - 1, &datablock_is_ok, &datablocksOk);
+
+					if (datablocksOk) {
+						struct ext2_inode *inode_entry = inode_from_index(disk, deleted_dir_entry->inode - 1);
+
+						if (deleted_dir_entry->file_type == EXT2_FT_DIR) {
+							errno = EISDIR;
+							data->done = 1;
+							return;
+						}
+
+						inode_entry->i_dtime = 0;
+						inode_entry->i_links_count++;
+						dir_entry->rec_len = dir_entry_size;
+						deleted_dir_entry->rec_len = padding;
+
+						data->dir_entry = deleted_dir_entry;
+
+						mark_inode_used(disk, deleted_dir_entry->inode - 1);
+						inode_block_foreach(disk, deleted_dir_entry->inode - 1, &set_datablock_in_bitmap, NULL);
+						inode_indirect_block_foreach(disk, deleted_dir_entry->inode - 1, &set_datablock_in_bitmap, NULL);
+
+						data->done = 1;
+					}
+				}
+
+				dir_entry = deleted_dir_entry;
+				dir_entry_size = rec_len_boundary(sizeof(struct ext2_dir_entry) + dir_entry->name_len);
+				padding -= rec_len_boundary(sizeof (struct ext2_dir_entry) + deleted_dir_entry->name_len);
+			} else {
+				padding = 0;
+			}
+		}
+
+	}
+}
+
+
+struct ext2_dir_entry *restore_dir_entry(unsigned char *disk, unsigned int inode, char *name) {
+	struct restore_dir_entry_data data;
+
+	data.name = name;
+	data.name_len = strlen(data.name);
+	data.done = 0;
+	data.dir_entry = NULL;
+
+	directory_entry_foreach(disk, inode, &restore_dir_entry_helper, &data);
+
+	if (!data.done) {
+		errno = ENOENT;
+	}
+
+	if (data.dir_entry != NULL) {
+		dentry_cache_insert(inode, name, data.dir_entry->inode - 1);
+		dir_free_space_forget(inode);
+	}
+
+	return data.dir_entry;
+}
+
+
+int ext2_restore(char *program, unsigned char *disk, char *abspath) {
+	if (!is_abs_path(abspath)) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EINVAL));
+		return -1;
+	}
+
+	char *path = get_filepath(abspath);
+	char *name = get_filename(abspath);
+
+	unsigned int file_inode = inode_by_filepath(disk, abspath);
+	if (file_inode != -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EEXIST));
+		return -1;
+	}
+
+	unsigned int path_inode = inode_by_filepath(disk, path);
+	if (path_inode == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, path, strerror(ENOENT));
+		return -1;
+	}
+
+	if (restore_dir_entry(disk, path_inode, name) == NULL) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int ext2_extract(char *program, unsigned char *disk, char *abspath, char *dest) {
+	if (!is_abs_path(abspath)) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EINVAL));
+		return -1;
+	}
+
+	unsigned int file_inode = inode_by_filepath(disk, abspath);
+	if (file_inode == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(ENOENT));
+		return -1;
+	}
+
+	if (S_ISDIR(inode_from_index(disk, file_inode)->i_mode)) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EISDIR));
+		return -1;
+	}
+
+	int dest_fd = STDOUT_FILENO;
+	if (dest != NULL) {
+		dest_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (dest_fd == -1) {
+			fprintf(stderr, "%s: %s: %s\n", program, dest, strerror(errno));
+			return -1;
+		}
+	}
+
+	int result = write_blocks_to_file(disk, file_inode, dest_fd);
+	if (result == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, dest != NULL ? dest : abspath, strerror(errno));
+	}
+
+	if (dest != NULL && close(dest_fd) == -1 && result == 0) {
+		fprintf(stderr, "%s: %s: %s\n", program, dest, strerror(errno));
+		result = -1;
+	}
+
+	return result;
+}
+
+
+/**
+ * ext2_extract -r walks the tree in the disk on the calling thread, creating the directories and
+ * symbolic links on the host as it goes and collecting the regular files. The files are then sorted
+ * by their first datablock and handed out in that order to a pool of threads, each writing its file
+ * straight out of the mapped image, so that the reads move through the image from start to end.
+ */
+struct extract_file {
+	unsigned int inode;
+	unsigned int block;
+	char *path;
+};
+
+struct extract_pool {
+	pthread_mutex_t lock;
+	struct extract_file *files;
+	unsigned int count;
+	unsigned int size;
+	unsigned int next;
+	bool failed;
+	char *program;
+	unsigned char *disk;
+};
+
+struct extract_tree_data {
+	struct extract_pool *pool;
+	char *path;
+};
+
+
+int extract_file_compare(const void *a, const void *b) {
+	const struct extract_file *file_a = a;
+	const struct extract_file *file_b = b;
+	if (file_a->block != file_b->block) {
+		return file_a->block < file_b->block ? -1 : 1;
+	}
+	return file_a->inode < file_b->inode ? -1 : file_a->inode > file_b->inode;
+}
+
+
+void *extract_worker(void *arg) {
+	struct extract_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->next < pool->count) {
+		struct extract_file *file = &pool->files[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		int fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		bool ok = fd != -1 && write_blocks_to_file(pool->disk, file->inode, fd) == 0;
+		int error = errno;
+		if (fd != -1 && close(fd) == -1 && ok) {
+			ok = false;
+			error = errno;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		if (!ok) {
+			fprintf(stderr, "%s: %s: %s\n", pool->program, file->path, strerror(error));
+			pool->failed = true;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+
+/**
+ * Creates the symbolic link at path on the host pointing to where the link inode points, returns
+ * false on failure.
+ */
+bool extract_symlink(unsigned char *disk, unsigned int inode, char *path) {
+	struct ext2_inode *inode_entry = inode_from_index(disk, inode);
+
+	// Short targets are kept in the inode itself, in place of the datablock pointers.
+	char *target;
+	if (inode_entry->i_blocks == 0) {
+		target = (char *) inode_entry->i_block;
+		if (inode_entry->i_size >= sizeof inode_entry->i_block) {
+			errno = EIO;
+			return false;
+		}
+	} else {
+		target = (char *) DISK_BLOCK(disk, inode_entry->i_block[0]);
+		if (inode_entry->i_block[0] == 0 || inode_entry->i_size >= DISK_BLOCK_SIZE(disk)) {
+			errno = EIO;
+			return false;
+		}
+	}
+
+	target = strndup(target, inode_entry->i_size);
+	if (target == NULL) {
+		perror("strndup");
+		exit(EXIT_FAILURE);
+	}
+	int result = symlink(target, path);
+	free(target);
+	return result == 0;
+}
+
+
+void extract_tree_helper(unsigned char *disk, struct ext2_dir_entry *dir_entry, void *arg);
+
+
+/**
+ * Recreates everything in the directory inode under the host directory at path, collecting the
+ * regular files to be written by the pool.
+ */
+void extract_tree(struct extract_pool *pool, unsigned int dir_inode, char *path) {
+	struct extract_tree_data data;
+	data.pool = pool;
+	data.path = path;
+	directory_entry_foreach(pool->disk, dir_inode, &extract_tree_helper, &data);
+}
+
+
+void extract_tree_helper(unsigned char *disk, struct ext2_dir_entry *dir_entry, void *arg) {
+	struct extract_tree_data *data = arg;
+	struct extract_pool *pool = data->pool;
+
+	if (dir_entry->inode == 0 || dir_entry->rec_len == 0 || is_dot_or_dot_dot(dir_entry->name, dir_entry->name_len)) {
+		return;
+	}
+
+	char *name = strndup(dir_entry->name, dir_entry->name_len);
+	if (name == NULL) {
+		perror("strndup");
+		exit(EXIT_FAILURE);
+	}
+	char *child_path = path_join(data->path, name);
+	free(name);
+
+	unsigned int inode = dir_entry->inode - 1;
+	struct ext2_inode *inode_entry = inode_from_index(disk, inode);
+
+	if (S_ISDIR(inode_entry->i_mode)) {
+		if (mkdir(child_path, 0755) == -1 && errno != EEXIST) {
+			fprintf(stderr, "%s: %s: %s\n", pool->program, child_path, strerror(errno));
+			pool->failed = true;
+		} else {
+			extract_tree(pool, inode, child_path);
+		}
+	} else if (S_ISREG(inode_entry->i_mode)) {
+		if (pool->count == pool->size) {
+			pool->size = pool->size ? pool->size * 2 : 64;
+			pool->files = realloc(pool->files, pool->size * sizeof (struct extract_file));
+			if (pool->files == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		pool->files[pool->count].inode = inode;
+		pool->files[pool->count].block = inode_entry->i_block[0];
+		pool->files[pool->count].path = child_path;
+		pool->count++;
+		return;
+	} else if (S_ISLNK(inode_entry->i_mode)) {
+		if (!extract_symlink(disk, inode, child_path)) {
+			fprintf(stderr, "%s: %s: %s\n", pool->program, child_path, strerror(errno));
+			pool->failed = true;
+		}
+	} else {
+		fprintf(stderr, "%s: %s: %s\n", pool->program, child_path, strerror(ENOTSUP));
+		pool->failed = true;
+	}
+
+	free(child_path);
+}
+
+
+int ext2_extract_recursive(char *program, unsigned char *disk, char *abspath, char *dest, unsigned int nthreads) {
+	if (!is_abs_path(abspath)) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(EINVAL));
+		return -1;
+	}
+
+	unsigned int dir_inode = inode_by_filepath(disk, abspath);
+	if (dir_inode == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, abspath, strerror(ENOENT));
+		return -1;
+	}
+	if (!S_ISDIR(inode_from_index(disk, dir_inode)->i_mode)) {
+		return ext2_extract(program, disk, abspath, dest);
+	}
+
+	// Like cp -r, extracting into an existing directory creates the source directory inside it.
+	trim_trailing_slash(abspath);
+	trim_trailing_slash(dest);
+	struct stat dest_stat;
+	if (stat(dest, &dest_stat) == 0 && S_ISDIR(dest_stat.st_mode)) {
+		if (strcmp(abspath, "/") != 0) {
+			dest = path_join(dest, get_filename(abspath));
+		}
+	}
+	if (mkdir(dest, 0755) == -1 && errno != EEXIST) {
+		fprintf(stderr, "%s: %s: %s\n", program, dest, strerror(errno));
+		return -1;
+	}
+
+	struct extract_pool *pool = malloc(sizeof (struct extract_pool));
+	if (pool == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->files = NULL;
+	pool->count = 0;
+	pool->size = 0;
+	pool->next = 0;
+	pool->failed = false;
+	pool->program = program;
+	pool->disk = disk;
+
+	extract_tree(pool, dir_inode, dest);
+	qsort(pool->files, pool->count, sizeof (struct extract_file), &extract_file_compare);
+
+	nthreads = MIN(nthreads, MAX(pool->count, 1));
+	pthread_t *threads = calloc(nthreads, sizeof (pthread_t));
+	if (threads == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned int i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, &extract_worker, pool) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (unsigned int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	bool failed = pool->failed;
+	for (unsigned int i = 0; i < pool->count; i++) {
+		free(pool->files[i].path);
+	}
+	free(pool->files);
+	free(threads);
+	free(pool);
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * Copyright (C) 2019
+ * Omar Chehab (omarchehab98@gmail.com)
+ * University of Toronto
+ */
+#ifndef EXT2_COMMANDS_H
+#define EXT2_COMMANDS_H
+
+#include "ext2_utils.h"
+
+/**
+ * The commands behind ext2_mkdir, ext2_cp, ext2_ln, ext2_rm, ext2_restore, and ext2_extract, so
+ * that they can also be run one after the other against a single mapping by ext2_batch.
+ *
+ * Each command prints its own error message prefixed with program, and returns -1 on failure or 0
+ * on success.
+ */
+
+/**
+ * Creates a directory in the disk at the absolute path.
+ */
+int ext2_mkdir(char *program, unsigned char *disk, char *path);
+
+/**
+ * Copies the source file from the host to the disk at the absolute dest path.
+ */
+int ext2_cp(char *program, unsigned char *disk, char *source, char *dest);
+
+/**
+ * Copies the source directory from the host, and everything under it, to the disk at the absolute
+ * dest path, reading the contents of the files on nthreads threads. Copies like ext2_cp when the
+ * source is not a directory.
+ */
+int ext2_cp_recursive(char *program, unsigned char *disk, char *source, char *dest, unsigned int nthreads);
+
+/**
+ * Creates a hard link, or a symbolic link if symbolic is set, at dest pointing to source.
+ */
+int ext2_ln(char *program, unsigned char *disk, char *source, char *dest, bool symbolic);
+
+/**
+ * Removes the file at the absolute path from the disk.
+ */
+int ext2_rm(char *program, unsigned char *disk, char *path);
+
+/**
+ * Restores the removed file at the absolute path on the disk.
+ */
+int ext2_restore(char *program, unsigned char *disk, char *path);
+
+/**
+ * Writes the contents of the file at the absolute path on the disk to the host file dest, or to
+ * standard out if dest is NULL.
+ */
+int ext2_extract(char *program, unsigned char *disk, char *path, char *dest);
+
+/**
+ * Extracts the directory at the absolute path on the disk, and everything under it, to the host at
+ * dest, writing the contents of the files on nthreads threads. Extracts like ext2_extract when the
+ * path is not a directory.
+ */
+int ext2_extract_recursive(char *program, unsigned char *disk, char *path, char *dest, unsigned int nthreads);
+
+#endif
@@ -3,39 +3,92 @@
  * Omar Chehab (omarchehab98@gmail.com)
  * University of Toronto
  */
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdbool.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include "ext2.h"
+#include <getopt.h>
+#include "ext2_utils.h"
 
 
+/**
+ * The dump is written as it is walked through stdout with a large buffer, so that it never has
+ * to be held in memory. Besides the text format, every superblock, group, inode, and directory
+ * entry can be written as its own record, one JSON object per line or one CSV row per line, for
+ * tools to parse and diff.
+ */
+#define DUMP_BUFFER_SIZE (1 << 20)
+
+enum dump_format { DUMP_FORMAT_TEXT, DUMP_FORMAT_JSON, DUMP_FORMAT_CSV };
+
 unsigned char *disk;
 
+enum dump_format format = DUMP_FORMAT_TEXT;
+
+/**
+ * Which parts of the image are dumped. Only the inodes from first to first + count - 1 are
+ * dumped, and with --path only the inodes under the path, collected in inode order.
+ */
+#define DUMP_SECTION_SUPER   0x1
+#define DUMP_SECTION_GROUPS  0x2
+#define DUMP_SECTION_INODES  0x4
+#define DUMP_SECTION_DIRENTS 0x8
+#define DUMP_SECTION_ALL     0xf
+
+struct dump_selection {
+	int sections;
+	unsigned int first;
+	unsigned int count;
+	unsigned int *path_inodes;
+	unsigned int path_inodes_len;
+	unsigned int path_inodes_size;
+	unsigned char *path_visited;
+};
+
+struct dump_selection selection = { DUMP_SECTION_ALL, 0, -1, NULL, 0, 0, NULL };
+
+char output_buffer[DUMP_BUFFER_SIZE];
+
+
+void usage(char *program) {
+	fprintf(stderr, "usage: %s [--format=text|json|csv] [--section=super,groups,inodes,dirents] [--inode A[-B]] [--path path] <image file name>\n", program);
+}
+
 
 char bit_to_char(unsigned char bit) {
 	return (char) (bit + 48);
 }
 
 
-char *bitmap_to_string(unsigned char *cs, int n) {
-	int i, j;
-	// (n bits for 1s and 0s) + (n / 8 bits for spaces) + (1 bit for null)
-	char *str = malloc((n + (n / 8) + 1) * sizeof(char));
-	if (str == NULL) {
-		perror("malloc");
-		exit(EXIT_FAILURE);
+/**
+ * Streams the first n bits of the bitmap to stdout, in text format with a space after every byte.
+ */
+void print_bitmap(unsigned char *bitmap, unsigned int n) {
+	for (unsigned int i = 0; i < n; i++) {
+		putchar_unlocked(bit_to_char(1 & bitmap[i / 8] >> i % 8));
+		if (format == DUMP_FORMAT_TEXT && (i % 8 == 7 || i == n - 1)) {
+			putchar_unlocked(' ');
+		}
 	}
-	for (i = 0; i < n / 8; i++) {
-		for (j = 0; j < 8; j++) {
-			str[i * 9 + j] = bit_to_char(1 & cs[i] >> j);
+}
+
+
+/**
+ * Prints the name quoted for the format, escaping it as a JSON string or as a CSV field.
+ */
+void print_name(char *name, unsigned char name_len) {
+	putchar_unlocked('"');
+	for (unsigned char i = 0; i < name_len; i++) {
+		unsigned char c = name[i];
+		if (format == DUMP_FORMAT_JSON && (c == '"' || c == '\\')) {
+			putchar_unlocked('\\');
+			putchar_unlocked(c);
+		} else if (format == DUMP_FORMAT_JSON && c < 0x20) {
+			printf("\\u%04x", c);
+		} else if (format == DUMP_FORMAT_CSV && c == '"') {
+			putchar_unlocked('"');
+			putchar_unlocked(c);
+		} else {
+			putchar_unlocked(c);
 		}
-		str[i * 9 + j] = ' ';
 	}
-	str[i * 9 + j] = '\0';
-	return str;
+	putchar_unlocked('"');
 }
 
 
@@ -70,148 +123,437 @@ bool inode_should_skip(unsigned int inode) {
 }
 
 
-bool inode_block_foreach_helper(unsigned int inode, unsigned int *i_block, unsigned int blocks, unsigned int indirection, void (*callback)(unsigned short, unsigned int, void *arg), void *arg) {
-	for (int i = 0; i < blocks; i++) {
-		unsigned int block = i_block[i];
-		if (block) {
-			if (indirection) {
-				(*callback)(inode, block, arg);
-				unsigned int *ib1 = (unsigned int *)(disk + EXT2_BLOCK_SIZE * block);
-				inode_block_foreach_helper(inode, ib1, 256, indirection - 1, callback, arg);
-			} else {
-				(*callback)(inode, block, arg);
-			}
-		} else {
-			return false;
-		}
+void print_inode_block(unsigned char *disk, unsigned int inode, unsigned int block, void *arg) {
+	bool *first = arg;
+	if (format == DUMP_FORMAT_TEXT) {
+		printf("%d ", BLOCK_NUMBER(disk, block));
+	} else {
+		printf(*first ? "%d" : format == DUMP_FORMAT_JSON ? ",%d" : " %d", BLOCK_NUMBER(disk, block));
 	}
-	return true;
+	*first = false;
+}
+
+
+void print_inode_blocks(unsigned int i) {
+	bool first = true;
+	inode_block_foreach(disk, i, &print_inode_block, &first);
 }
 
 
-void inode_block_foreach(unsigned int inode, void (*callback)(unsigned short, unsigned int, void *), void *arg) {
-	struct ext2_group_desc *bg = (struct ext2_group_desc *)(disk + EXT2_BLOCK_SIZE * 2);
-	struct ext2_inode *inode_tbl = (struct ext2_inode *)(disk + EXT2_BLOCK_SIZE * bg->bg_inode_table);
+void print_inode_indirect_blocks(unsigned int i) {
+	bool first = true;
+	inode_indirect_block_foreach(disk, i, &print_inode_block, &first);
+}
+
 
-	struct ext2_inode in = inode_tbl[inode];
-	inode_block_foreach_helper(inode, in.i_block, 12, 0, callback, arg)
-		&& inode_block_foreach_helper(inode, in.i_block + 12, 1, 1, callback, arg)
-		&& inode_block_foreach_helper(inode, in.i_block + 13, 1, 2, callback, arg)
-		&& inode_block_foreach_helper(inode, in.i_block + 14, 1, 3, callback, arg);
+/**
+ * Prints the block, and when it is an indirect block of the given depth, the blocks it maps after
+ * it, skipping holes.
+ */
+void print_block_tree(unsigned int block, unsigned int depth, bool *first) {
+	if (!block) {
+		return;
+	}
+	print_inode_block(disk, 0, BLOCK_INDEX(disk, block), first);
+	if (depth > 0) {
+		unsigned int *table = (unsigned int *) DISK_BLOCK(disk, block);
+		for (unsigned int i = 0; i < DISK_BLOCK_SIZE(disk) / sizeof (unsigned int); i++) {
+			print_block_tree(table[i], depth - 1, first);
+		}
+	}
 }
 
 
-void print_inode_block(unsigned short inode, unsigned int iblock, void *arg) {
-	printf("%d ", iblock);
+/**
+ * Prints every block of the inode, datablocks and indirect blocks together, each indirect block
+ * right before the blocks it maps, as the text format always has.
+ */
+void print_inode_block_tree(unsigned int i) {
+	struct ext2_inode *inode_entry = inode_from_index(disk, i);
+	bool first = true;
+
+	// Short symbolic link targets are kept in place of the block numbers.
+	if (S_ISLNK(inode_entry->i_mode) && inode_entry->i_blocks == 0) {
+		return;
+	}
+	for (unsigned int n = 0; n < 15; n++) {
+		print_block_tree(inode_entry->i_block[n], n < 12 ? 0 : n - 11, &first);
+	}
 }
 
 
-void print_inode_blocks(unsigned int i) {
-	inode_block_foreach(i, &print_inode_block, NULL);
+bool is_inode_selected(unsigned int inode) {
+	return inode - selection.first < selection.count;
 }
 
 
-void inode_foreach(void (*callback)(unsigned int, void *), void *arg) {
-	struct ext2_super_block *s = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE * 1);
-	struct ext2_group_desc *bg = (struct ext2_group_desc *)(disk + EXT2_BLOCK_SIZE * 2);
-	unsigned char *inode_bitmap = (unsigned char *)(disk + EXT2_BLOCK_SIZE * bg->bg_inode_bitmap);
+void dump_inode_foreach_helper(unsigned char *disk, unsigned int inode, void *arg) {
+	void (*callback)(unsigned char *, unsigned int, void *) = arg;
+	if (!is_inode_free(disk, inode) && !inode_should_skip(inode + 1)) {
+		(*callback)(disk, inode, NULL);
+	}
+}
 
-	for (unsigned int i = 0; i < s->s_inodes_count / 8; i++) {
-		for (unsigned int j = 0; j < 8; j++) {
-			unsigned int index = i * 8 + j + 1;
-			if (1 & inode_bitmap[i] >> j && !inode_should_skip(index)) {
-				(*callback)(index - 1, arg);
+
+/**
+ * Calls the callback for each inode in use that is selected, in inode order.
+ */
+void dump_inode_foreach(void (*callback)(unsigned char *, unsigned int, void *)) {
+	if (selection.path_inodes != NULL) {
+		for (unsigned int i = 0; i < selection.path_inodes_len; i++) {
+			if (is_inode_selected(selection.path_inodes[i])) {
+				(*callback)(disk, selection.path_inodes[i], NULL);
 			}
 		}
+	} else {
+		inode_range_foreach(disk, selection.first, selection.count, &dump_inode_foreach_helper, callback);
 	}
 }
 
 
-void print_inode(unsigned int i, void *arg) {
-	struct ext2_group_desc *bg = (struct ext2_group_desc *)(disk + EXT2_BLOCK_SIZE * 2);
-	struct ext2_inode *inode_tbl = (struct ext2_inode *)(disk + EXT2_BLOCK_SIZE * bg->bg_inode_table);
+void select_path_inode(unsigned int inode);
 
-	struct ext2_inode inode = inode_tbl[i];
-	printf("[%d] type: %c size: %d links: %d blocks: %d\n", i + 1, inode_filemode_to_string(inode.i_mode), inode.i_size, inode.i_links_count, inode.i_blocks);
-	printf("[%d] Blocks:  ", i + 1);
-	print_inode_blocks(i);
-	printf("\n");
+
+void select_path_helper(unsigned char *disk, struct ext2_dir_entry *dir_entry, void *arg) {
+	if (dir_entry->inode != 0 && dir_entry->inode <= DISK_SUPER_BLOCK(disk)->s_inodes_count && !is_dot_or_dot_dot(dir_entry->name, dir_entry->name_len)) {
+		select_path_inode(dir_entry->inode - 1);
+	}
+}
+
+
+/**
+ * Adds the inode, and everything below it if it is a directory, to the selected path inodes.
+ * Each inode is only added once, even if it is reachable through more than one hard link.
+ */
+void select_path_inode(unsigned int inode) {
+	if (is_bit_set_by_index(selection.path_visited, inode)) {
+		return;
+	}
+	set_bit_by_index(selection.path_visited, inode);
+
+	if (selection.path_inodes_len == selection.path_inodes_size) {
+		selection.path_inodes_size = selection.path_inodes_size ? selection.path_inodes_size * 2 : 64;
+		selection.path_inodes = realloc(selection.path_inodes, selection.path_inodes_size * sizeof (unsigned int));
+		if (selection.path_inodes == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	selection.path_inodes[selection.path_inodes_len++] = inode;
+
+	directory_entry_foreach(disk, inode, &select_path_helper, NULL);
+}
+
+
+int compare_inodes(const void *a, const void *b) {
+	unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+	return x < y ? -1 : x > y;
+}
+
+
+void print_inode(unsigned char *disk, unsigned int i, void *arg) {
+	struct ext2_inode inode = *inode_from_index(disk, i);
+	char type = inode_filemode_to_string(inode.i_mode);
+
+	if (format == DUMP_FORMAT_JSON) {
+		printf("{\"record\":\"inode\",\"inode\":%d,\"type\":\"%c\",\"size\":%d,\"links\":%d,\"blocks\":%d,\"block_list\":[", i + 1, type, inode.i_size, inode.i_links_count, inode.i_blocks);
+		print_inode_blocks(i);
+		printf("],\"indirect_list\":[");
+		print_inode_indirect_blocks(i);
+		printf("]}\n");
+	} else if (format == DUMP_FORMAT_CSV) {
+		printf("inode,%d,%c,%d,%d,%d,", i + 1, type, inode.i_size, inode.i_links_count, inode.i_blocks);
+		print_inode_blocks(i);
+		printf(",");
+		print_inode_indirect_blocks(i);
+		printf("\n");
+	} else {
+		printf("[%d] type: %c size: %d links: %d blocks: %d\n", i + 1, type, inode.i_size, inode.i_links_count, inode.i_blocks);
+		printf("[%d] Blocks:  ", i + 1);
+		print_inode_block_tree(i);
+		printf("\n");
+	}
 }
 
 
-void print_directory_helper(unsigned short inode, unsigned int iblock, void *arg) {
+void print_directory_helper(unsigned char *disk, unsigned int inode, unsigned int block, void *arg) {
 	struct ext2_dir_entry *e;
 	unsigned short rec_total;
-	unsigned char *ep = disk + EXT2_BLOCK_SIZE * iblock;
+	unsigned int iblock = BLOCK_NUMBER(disk, block);
+	unsigned char *ep = DISK_BLOCK(disk, iblock);
 
-	printf("   DIR BLOCK NUM: %d (for inode %d)\n", iblock, inode + 1);
-	for (rec_total = 0; rec_total < EXT2_BLOCK_SIZE; rec_total += e->rec_len, ep += e->rec_len) {
+	if (format == DUMP_FORMAT_TEXT) {
+		printf("   DIR BLOCK NUM: %d (for inode %d)\n", iblock, inode + 1);
+	}
+	for (rec_total = 0; rec_total < DISK_BLOCK_SIZE(disk); rec_total += e->rec_len, ep += e->rec_len) {
 		e = (struct ext2_dir_entry *)(ep);
+		if (e->rec_len == 0) {
+			break;
+		}
 
 		char file_type = dir_entry_file_type_to_string(e->file_type);
 
-		printf("Inode: %d rec_len: %d name_len: %d type= %c name=%.*s\n", e->inode, e->rec_len, e->name_len, file_type, e->name_len, e->name);
+		if (format == DUMP_FORMAT_JSON) {
+			printf("{\"record\":\"dirent\",\"dir\":%d,\"block\":%d,\"inode\":%d,\"rec_len\":%d,\"name_len\":%d,\"type\":\"%c\",\"name\":", inode + 1, iblock, e->inode, e->rec_len, e->name_len, file_type);
+			print_name(e->name, e->name_len);
+			printf("}\n");
+		} else if (format == DUMP_FORMAT_CSV) {
+			printf("dirent,%d,%d,%d,%d,%d,%c,", inode + 1, iblock, e->inode, e->rec_len, e->name_len, file_type);
+			print_name(e->name, e->name_len);
+			printf("\n");
+		} else {
+			printf("Inode: %d rec_len: %d name_len: %d type= %c name=%.*s\n", e->inode, e->rec_len, e->name_len, file_type, e->name_len, e->name);
+		}
 	}
 }
 
 
-void print_directory(unsigned int i, void *arg) {
-	struct ext2_group_desc *bg = (struct ext2_group_desc *)(disk + EXT2_BLOCK_SIZE * 2);
-	struct ext2_inode *inode_tbl = (struct ext2_inode *)(disk + EXT2_BLOCK_SIZE * bg->bg_inode_table);
-
-	struct ext2_inode inode = inode_tbl[i];
+void print_directory(unsigned char *disk, unsigned int i, void *arg) {
+	struct ext2_inode inode = *inode_from_index(disk, i);
 	if (S_ISDIR(inode.i_mode)) {
-		inode_block_foreach(i, &print_directory_helper, arg);
+		inode_block_foreach(disk, i, &print_directory_helper, arg);
+	}
+}
+
+
+void print_super_block() {
+	struct ext2_super_block *s = DISK_SUPER_BLOCK(disk);
+
+	if (format == DUMP_FORMAT_JSON) {
+		printf("{\"record\":\"superblock\",\"inodes\":%d,\"blocks\":%d,\"block_size\":%d,\"groups\":%d,\"free_inodes\":%d,\"free_blocks\":%d}\n", s->s_inodes_count, s->s_blocks_count, DISK_BLOCK_SIZE(disk), DISK_GROUP_COUNT(disk), s->s_free_inodes_count, s->s_free_blocks_count);
+	} else if (format == DUMP_FORMAT_CSV) {
+		printf("record,inodes,blocks,block_size,groups,free_inodes,free_blocks\n");
+		printf("superblock,%d,%d,%d,%d,%d,%d\n", s->s_inodes_count, s->s_blocks_count, DISK_BLOCK_SIZE(disk), DISK_GROUP_COUNT(disk), s->s_free_inodes_count, s->s_free_blocks_count);
+	} else {
+		printf("Inodes: %d\n", s->s_inodes_count);
+		printf("Blocks: %d\n", s->s_blocks_count);
 	}
 }
 
 
+void print_group(unsigned int group) {
+	struct ext2_super_block *s = DISK_SUPER_BLOCK(disk);
+	struct ext2_group_desc *bg = DISK_GROUP_DESC(disk, group);
+
+	if (format == DUMP_FORMAT_TEXT) {
+		printf("Block group:\n");
+		printf("    block bitmap: %d\n", bg->bg_block_bitmap);
+		printf("    inode bitmap: %d\n", bg->bg_inode_bitmap);
+		printf("    inode table: %d\n", bg->bg_inode_table);
+		printf("    free blocks: %d\n", bg->bg_free_blocks_count);
+		printf("    free inodes: %d\n", bg->bg_free_inodes_count);
+		printf("    used_dirs: %d\n", bg->bg_used_dirs_count);
+		return;
+	}
+
+	printf(format == DUMP_FORMAT_JSON
+		? "{\"record\":\"group\",\"group\":%d,\"block_bitmap\":%d,\"inode_bitmap\":%d,\"inode_table\":%d,\"free_blocks\":%d,\"free_inodes\":%d,\"used_dirs\":%d,\"block_bits\":\""
+		: "group,%d,%d,%d,%d,%d,%d,%d,",
+		group, bg->bg_block_bitmap, bg->bg_inode_bitmap, bg->bg_inode_table, bg->bg_free_blocks_count, bg->bg_free_inodes_count, bg->bg_used_dirs_count);
+	print_bitmap(DISK_BLOCK_BITMAP(disk, group), group_blocks_count(disk, group));
+	printf(format == DUMP_FORMAT_JSON ? "\",\"inode_bits\":\"" : ",");
+	print_bitmap(DISK_INODE_BITMAP(disk, group), s->s_inodes_per_group);
+	printf(format == DUMP_FORMAT_JSON ? "\"}\n" : "\n");
+}
+
+
+/**
+ * Parses a comma separated list of section names, returns the sections or -1 if one is unknown.
+ */
+int parse_sections(char *list) {
+	int sections = 0;
+
+	for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+		if (strcmp(name, "super") == 0) {
+			sections |= DUMP_SECTION_SUPER;
+		} else if (strcmp(name, "groups") == 0) {
+			sections |= DUMP_SECTION_GROUPS;
+		} else if (strcmp(name, "inodes") == 0) {
+			sections |= DUMP_SECTION_INODES;
+		} else if (strcmp(name, "dirents") == 0) {
+			sections |= DUMP_SECTION_DIRENTS;
+		} else {
+			return -1;
+		}
+	}
+
+	return sections;
+}
+
+
+/**
+ * Parses an inode number A, or a range of inode numbers A-B, into the selection, returns -1 if it
+ * is not a valid range or 0 on success.
+ */
+int parse_inode_range(char *range) {
+	char *end;
+	unsigned long first = strtoul(range, &end, 10);
+	unsigned long last = first;
+
+	if (*end == '-') {
+		last = strtoul(end + 1, &end, 10);
+	}
+	if (*end != '\0' || first == 0 || last < first || last > UINT32_MAX) {
+		return -1;
+	}
+
+	selection.first = first - 1;
+	selection.count = last - first + 1;
+	return 0;
+}
+
+
 int main(int argc, char **argv) {
+	char *path = NULL;
+	int opt;
+
+	struct option long_options[] = {
+		{ "format", required_argument, NULL, 'f' },
+		{ "section", required_argument, NULL, 's' },
+		{ "inode", required_argument, NULL, 'i' },
+		{ "path", required_argument, NULL, 'p' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'f':
+				if (strcmp(optarg, "text") == 0) {
+					format = DUMP_FORMAT_TEXT;
+				} else if (strcmp(optarg, "json") == 0) {
+					format = DUMP_FORMAT_JSON;
+				} else if (strcmp(optarg, "csv") == 0) {
+					format = DUMP_FORMAT_CSV;
+				} else {
+					usage(get_filename(argv[0]));
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 's':
+				selection.sections = parse_sections(optarg);
+				if (selection.sections <= 0) {
+					usage(get_filename(argv[0]));
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'i':
+				if (parse_inode_range(optarg) == -1) {
+					usage(get_filename(argv[0]));
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'p':
+				path = optarg;
+				break;
+
+			default:
+				usage(get_filename(argv[0]));
+				exit(EXIT_FAILURE);
+		}
+	}
 
-	if(argc != 2) {
-		fprintf(stderr, "usage: %s <image file name>\n", argv[0]);
-		exit(1);
+	if (argc - optind != 1) {
+		usage(get_filename(argv[0]));
+		exit(EXIT_FAILURE);
 	}
-	int fd = open(argv[1], O_RDWR);
-	if(fd == -1) {
-		perror("open");
-		exit(1);
+
+	if (path != NULL && !is_abs_path(path)) {
+		fprintf(stderr, "%s: %s: %s\n", get_filename(argv[0]), path, strerror(EINVAL));
+		exit(EXIT_FAILURE);
 	}
 
-	disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if(disk == MAP_FAILED) {
-		perror("mmap");
-		exit(1);
+	// A targeted dump jumps straight to the inodes and blocks it needs instead of reading ahead.
+	bool targeted = path != NULL || selection.count != -1;
+	disk = load_disk(argv[optind], LOAD_DISK_READ_ONLY | (targeted ? LOAD_DISK_RANDOM : LOAD_DISK_SEQUENTIAL | LOAD_DISK_POPULATE));
+
+	if (setvbuf(stdout, output_buffer, _IOFBF, sizeof output_buffer) != 0) {
+		perror(get_filename(argv[0]));
+		exit(EXIT_FAILURE);
 	}
 
-	struct ext2_super_block *s = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE * 1);
-	printf("Inodes: %d\n", s->s_inodes_count);
-	printf("Blocks: %d\n", s->s_blocks_count);
+	struct ext2_super_block *s = DISK_SUPER_BLOCK(disk);
+	unsigned int groups = DISK_GROUP_COUNT(disk);
+
+	selection.first = MIN(selection.first, s->s_inodes_count);
+	selection.count = MIN(selection.count, s->s_inodes_count - selection.first);
 
-	struct ext2_group_desc *bg = (struct ext2_group_desc *)(disk + EXT2_BLOCK_SIZE * 2);
-	printf("Block group:\n");
-	printf("    block bitmap: %d\n", bg->bg_block_bitmap);
-	printf("    inode bitmap: %d\n", bg->bg_inode_bitmap);
-	printf("    inode table: %d\n", bg->bg_inode_table);
-	printf("    free blocks: %d\n", bg->bg_free_blocks_count);
-	printf("    free inodes: %d\n", bg->bg_free_inodes_count);
-	printf("    used_dirs: %d\n", bg->bg_used_dirs_count);
+	if (path != NULL) {
+		unsigned int inode = inode_by_filepath(disk, path);
+		if (inode == -1) {
+			fprintf(stderr, "%s: %s: %s\n", get_filename(argv[0]), path, strerror(ENOENT));
+			exit(EXIT_FAILURE);
+		}
 
-	unsigned char *block_bitmap = (unsigned char *)(disk + EXT2_BLOCK_SIZE * bg->bg_block_bitmap);
-	printf("Block bitmap: %s\n", bitmap_to_string(block_bitmap, s->s_blocks_count));
+		selection.path_visited = calloc(s->s_inodes_count / 8 + 1, sizeof (unsigned char));
+		if (selection.path_visited == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		select_path_inode(inode);
+		qsort(selection.path_inodes, selection.path_inodes_len, sizeof (unsigned int), &compare_inodes);
+	}
 
-	unsigned char *inode_bitmap = (unsigned char *)(disk + EXT2_BLOCK_SIZE * bg->bg_inode_bitmap);
-	printf("Inode bitmap: %s\n", bitmap_to_string(inode_bitmap, s->s_inodes_count));
-	
-	printf("\n");
+	if (selection.sections & DUMP_SECTION_SUPER) {
+		print_super_block();
+	}
 
-	printf("Inodes:\n");
-	
-	inode_foreach(&print_inode, NULL);
-	printf("\n");
+	if (selection.sections & DUMP_SECTION_GROUPS) {
+		if (format == DUMP_FORMAT_CSV) {
+			printf("record,group,block_bitmap,inode_bitmap,inode_table,free_blocks,free_inodes,used_dirs,block_bits,inode_bits\n");
+		}
+		for (unsigned int group = 0; group < groups; group++) {
+			print_group(group);
+		}
+
+		if (format == DUMP_FORMAT_TEXT) {
+			// The bitmaps of every group are streamed one after the other on a single line.
+			printf("Block bitmap: ");
+			for (unsigned int group = 0; group < groups; group++) {
+				print_bitmap(DISK_BLOCK_BITMAP(disk, group), group_blocks_count(disk, group));
+			}
+			printf("\n");
 
-	printf("Directory Blocks:\n");
-	inode_foreach(&print_directory, NULL);
+			printf("Inode bitmap: ");
+			for (unsigned int group = 0; group < groups; group++) {
+				print_bitmap(DISK_INODE_BITMAP(disk, group), s->s_inodes_per_group);
+			}
+			printf("\n");
+
+			printf("\n");
+		}
+	}
+
+	if (selection.sections & DUMP_SECTION_INODES) {
+		if (format == DUMP_FORMAT_TEXT) {
+			printf("Inodes:\n");
+		} else if (format == DUMP_FORMAT_CSV) {
+			printf("record,inode,type,size,links,blocks,block_list,indirect_list\n");
+		}
+
+		dump_inode_foreach(&print_inode);
+
+		if (format == DUMP_FORMAT_TEXT) {
+			printf("\n");
+		}
+	}
+
+	if (selection.sections & DUMP_SECTION_DIRENTS) {
+		if (format == DUMP_FORMAT_TEXT) {
+			printf("Directory Blocks:\n");
+		} else if (format == DUMP_FORMAT_CSV) {
+			printf("record,dir,block,inode,rec_len,name_len,type,name\n");
+		}
+
+		dump_inode_foreach(&print_directory);
+	}
+
+	if (fflush(stdout) == EOF) {
+		perror(get_filename(argv[0]));
+		exit(EXIT_FAILURE);
+	}
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,55 @@
+/**
+ * Copyright (C) 2019
+ * Omar Chehab (omarchehab98@gmail.com)
+ * University of Toronto
+ */
+#include "ext2_commands.h"
+
+unsigned char *disk;
+
+void usage(char *program) {
+	fprintf(stderr, "usage: %s [-r] [-j jobs] <image file name> <path> [path to dest]\n", program);
+}
+
+int main(int argc, char **argv) {
+	bool recursive = false;
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	while ((opt = getopt(argc, argv, "rj:")) != -1) {
+		switch (opt) {
+			case 'r':
+				recursive = true;
+				break;
+
+			case 'j':
+				nthreads = strtol(optarg, NULL, 10);
+				if (nthreads <= 0) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind != 3 && (recursive || argc - optind != 2)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	disk = load_disk(argv[optind], LOAD_DISK_READ_ONLY | LOAD_DISK_SEQUENTIAL);
+
+	char *dest = argc - optind == 3 ? argv[optind + 2] : NULL;
+	int result = recursive
+		? ext2_extract_recursive(get_filename(argv[0]), disk, argv[optind + 1], dest, nthreads > 0 ? nthreads : 1)
+		: ext2_extract(get_filename(argv[0]), disk, argv[optind + 1], dest);
+	if (result == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	return 0;
+}
@@ -6,31 +6,118 @@
 #include "ext2_utils.h"
 
 
-unsigned char *load_disk(char *path) {
-	int fd = open(path, O_RDWR);
+/**
+ * Allocation cursors, every inode and block index below them is known to be in use.
+ * 
+ * They only move back when an inode or block is freed, so allocations still return the lowest
+ * free index, without rescanning the full part of the bitmaps every time.
+ */
+static unsigned int inode_cursor = EXT2_GOOD_OLD_FIRST_INO;
+static unsigned int block_cursor = 0;
+
+
+/**
+ * Dentry cache, maps a (parent inode, name) pair to the inode it names, or to -1 when the name is
+ * known not to exist. Chained hash table that doubles when it gets as full as it has buckets.
+ */
+struct dentry {
+	struct dentry *next;
+	unsigned int parent;
+	unsigned int inode;
+	unsigned char name_len;
+	char name[];
+};
+
+static struct dentry **dentry_table = NULL;
+static unsigned int dentry_table_size = 0;
+static unsigned int dentry_count = 0;
+
+/**
+ * Directories of at least DENTRY_INDEX_MIN_BLOCKS blocks are indexed whole the first time a name
+ * in them misses the dentry cache. From then on every entry in them is in the cache, so a miss
+ * means the name does not exist, and a lookup never scans the directory again.
+ */
+#define DENTRY_INDEX_MIN_BLOCKS 4
+
+static unsigned char *dentry_indexed = NULL;
+
+
+unsigned char *load_disk(char *path, int flags) {
+	bool read_only = flags & LOAD_DISK_READ_ONLY;
+
+	int fd = open(path, read_only ? O_RDONLY : O_RDWR);
 	if (fd == -1) {
 		perror("open");
 		exit(EXIT_FAILURE);
 	}
 
-	unsigned char *disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	// The superblock lives at a fixed offset, so it can be read before anything is mapped.
+	struct ext2_super_block super_block;
+	ssize_t nread = pread(fd, &super_block, sizeof (struct ext2_super_block), EXT2_SUPER_BLOCK_OFFSET);
+	if (nread == -1) {
+		perror("pread");
+		exit(EXIT_FAILURE);
+	}
+	if (nread != sizeof (struct ext2_super_block) || super_block.s_magic != EXT2_SUPER_MAGIC) {
+		fprintf(stderr, "%s: not an ext2 image\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if ((EXT2_MIN_BLOCK_SIZE << super_block.s_log_block_size) > EXT2_MAX_BLOCK_SIZE) {
+		fprintf(stderr, "%s: unsupported block size\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned long long size = (unsigned long long) super_block.s_blocks_count * (EXT2_MIN_BLOCK_SIZE << super_block.s_log_block_size);
+	if (size > (unsigned long long) st.st_size || size > SIZE_MAX) {
+		fprintf(stderr, "%s: image is smaller than its file system (%llu < %llu bytes)\n", path, (unsigned long long) st.st_size, size);
+		exit(EXIT_FAILURE);
+	}
+
+	int prot = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+	int map_flags = read_only ? MAP_PRIVATE : MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (flags & LOAD_DISK_POPULATE) {
+		map_flags |= MAP_POPULATE;
+	}
+#endif
+
+	unsigned char *disk = mmap(NULL, size, prot, map_flags, fd, 0);
 	if (disk == MAP_FAILED) {
 		perror("mmap");
 		exit(EXIT_FAILURE);
 	}
+	close(fd);
+
+	if (flags & LOAD_DISK_SEQUENTIAL) {
+		madvise(disk, size, MADV_SEQUENTIAL);
+	} else if (flags & LOAD_DISK_RANDOM) {
+		madvise(disk, size, MADV_RANDOM);
+	}
 
 	return disk;
 }
 
 
+int sync_disk(unsigned char *disk) {
+	size_t size = (size_t) DISK_SUPER_BLOCK(disk)->s_blocks_count * DISK_BLOCK_SIZE(disk);
+	return msync(disk, size, MS_SYNC);
+}
+
+
 struct ext2_inode *inode_from_index(unsigned char *disk, unsigned int inode) {
-	unsigned char *inode_tbl = (unsigned char *) DISK_INODE_TABLE(disk);
-	return (struct ext2_inode *)(inode_tbl + (sizeof(struct ext2_inode) * inode));
+	unsigned char *inode_tbl = DISK_INODE_TABLE(disk, INODE_GROUP(disk, inode));
+	return (struct ext2_inode *)(inode_tbl + DISK_INODE_SIZE(disk) * INODE_GROUP_INDEX(disk, inode));
 }
 
 
 struct ext2_dir_entry *dir_entry_from_index(unsigned char *disk, unsigned int block) {
-	return (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * block);
+	return (struct ext2_dir_entry *) DISK_BLOCK(disk, block);
 }
 
 
@@ -39,92 +126,286 @@ bool is_inode_reserved(unsigned int inode) {
 }
 
 
-void inode_block_foreach(unsigned char *disk, unsigned int inode, void (*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg) {
-	struct ext2_inode *inode_entry = inode_from_index(disk, inode);
-	inode_block_foreach_helper(disk, inode, inode_entry->i_block, 12, 0, callback, arg)
-		&& inode_block_foreach_helper(disk, inode, inode_entry->i_block + 12, 1, 1, callback, arg)
-		&& inode_block_foreach_helper(disk, inode, inode_entry->i_block + 13, 1, 2, callback, arg)
-		&& inode_block_foreach_helper(disk, inode, inode_entry->i_block + 14, 1, 3, callback, arg);
-}
-
-
-bool inode_block_foreach_helper(unsigned char *disk, unsigned int inode, unsigned int *iblocks_tbl, unsigned int nblocks, unsigned int indirection, void (*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg) {
-	for (int i = 0; i < nblocks; i++) {
-		unsigned int block = iblocks_tbl[i] - 1;
-		if (block != -1) {
-			if (indirection) {
-				unsigned int *ib1 = (unsigned int *)(disk + EXT2_BLOCK_SIZE * block);
-				inode_block_foreach_helper(disk, inode, ib1, 256, indirection - 1, callback, arg);
-			} else {
-				(*callback)(disk, inode, block, arg);
-			}
-		} else {
+/**
+ * Calls the callback for each datablock in a table of block numbers, skipping holes, where n is the
+ * position in the contents of the first one. Returns false once the end of the contents is reached.
+ */
+static inline __attribute__((always_inline)) bool block_table_foreach(unsigned char *disk, unsigned int inode, unsigned int *iblocks_tbl, unsigned int nblocks, unsigned int *n, unsigned int end, unsigned int first_data_block, void (*callback)(unsigned char *, unsigned int, unsigned int, unsigned int, void *), void *arg) {
+	for (unsigned int i = 0; i < nblocks; i++, (*n)++) {
+		if (*n >= end) {
 			return false;
 		}
+		if (iblocks_tbl[i]) {
+			(*callback)(disk, inode, *n, iblocks_tbl[i] - first_data_block, arg);
+		}
 	}
-	return true;
+	return *n < end;
 }
 
 
-struct ext2_dir_entry *inode_dir_entry_find(unsigned char *disk, unsigned int inode, struct ext2_dir_entry *(*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg) {
+/**
+ * Walks the direct, single, double, and triple indirect blocks of an inode, up to the end of its
+ * contents. A missing block, or a missing indirect block, is a hole in a sparse file and is
+ * skipped over.
+ * 
+ * Always inlined with a constant block size so that the number of block numbers per indirect
+ * block, and the address of each indirect block, are computed without a runtime divide.
+ */
+static inline __attribute__((always_inline)) void inode_block_foreach_kernel(unsigned char *disk, unsigned int inode, const unsigned int block_size, void (*callback)(unsigned char *, unsigned int, unsigned int, unsigned int, void *), void *arg) {
+	const unsigned int nblocks = block_size / sizeof (unsigned int);
+	unsigned int first_data_block = DISK_SUPER_BLOCK(disk)->s_first_data_block;
 	struct ext2_inode *inode_entry = inode_from_index(disk, inode);
-	struct ext2_dir_entry *result = inode_dir_entry_find_helper(disk, inode, inode_entry->i_block, 12, 0, callback, arg);
-	if (result != NULL) return result;
-	result = inode_dir_entry_find_helper(disk, inode, inode_entry->i_block + 12, 1, 1, callback, arg);
-	if (result != NULL) return result;
-	// TODO: Haven't figured out how to make this more efficient, it currently searches through all
-	// dir entries, can optimize later.
-
-	// result = inode_dir_entry_find_helper(disk, inode, inode_entry->i_block + 13, 1, 2, callback, arg);
-	// if (result != NULL) return result;
-	// result = inode_dir_entry_find_helper(disk, inode, inode_entry->i_block + 14, 1, 3, callback, arg);
-	// if (result != NULL) return result;
-	return NULL;
+	unsigned int *i_block = inode_entry->i_block;
+	unsigned int *ib1, *ib2, *ib3;
+	unsigned int end = ((size_t) inode_entry->i_size + block_size - 1) / block_size;
+	unsigned int n = 0;
+
+	// Short symbolic link targets are kept in place of the block numbers.
+	if (S_ISLNK(inode_entry->i_mode) && inode_entry->i_blocks == 0) {
+		return;
+	}
+
+	if (!block_table_foreach(disk, inode, i_block, 12, &n, end, first_data_block, callback, arg)) {
+		return;
+	}
+	if (!i_block[12]) {
+		n += nblocks;
+	} else {
+		ib1 = (unsigned int *)(disk + (size_t) block_size * i_block[12]);
+		block_table_foreach(disk, inode, ib1, nblocks, &n, end, first_data_block, callback, arg);
+	}
+
+	if (n >= end) {
+		return;
+	}
+	if (!i_block[13]) {
+		n += nblocks * nblocks;
+	} else {
+		ib2 = (unsigned int *)(disk + (size_t) block_size * i_block[13]);
+		for (unsigned int i = 0; i < nblocks && n < end; i++) {
+			if (!ib2[i]) {
+				n += nblocks;
+				continue;
+			}
+			ib1 = (unsigned int *)(disk + (size_t) block_size * ib2[i]);
+			block_table_foreach(disk, inode, ib1, nblocks, &n, end, first_data_block, callback, arg);
+		}
+	}
+
+	if (n >= end || !i_block[14]) {
+		return;
+	}
+	ib3 = (unsigned int *)(disk + (size_t) block_size * i_block[14]);
+	for (unsigned int i = 0; i < nblocks && n < end; i++) {
+		if (!ib3[i]) {
+			n += nblocks * nblocks;
+			continue;
+		}
+		ib2 = (unsigned int *)(disk + (size_t) block_size * ib3[i]);
+		for (unsigned int j = 0; j < nblocks && n < end; j++) {
+			if (!ib2[j]) {
+				n += nblocks;
+				continue;
+			}
+			ib1 = (unsigned int *)(disk + (size_t) block_size * ib2[j]);
+			block_table_foreach(disk, inode, ib1, nblocks, &n, end, first_data_block, callback, arg);
+		}
+	}
 }
 
 
-struct ext2_dir_entry *inode_dir_entry_find_helper(unsigned char *disk, unsigned int inode, unsigned int *iblocks_tbl, unsigned int nblocks, unsigned int indirection, struct ext2_dir_entry *(*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg) {
-	for (int i = 0; i < nblocks; i++) {
-		unsigned int block = iblocks_tbl[i];
-		if (block) {
-			if (indirection) {
-				unsigned int *ib1 = (unsigned int *)(disk + EXT2_BLOCK_SIZE * block);
-				struct ext2_dir_entry *dir_entry = inode_dir_entry_find_helper(disk, inode, ib1, 256, indirection - 1, callback, arg);
-				if (dir_entry != NULL) {
-					return dir_entry;
-				}
-			} else {
-				struct ext2_dir_entry *dir_entry = (*callback)(disk, inode, block, arg);
-				if (dir_entry != NULL) {
-					return dir_entry->inode ? dir_entry : NULL;
+void inode_file_block_foreach(unsigned char *disk, unsigned int inode, void (*callback)(unsigned char *, unsigned int, unsigned int, unsigned int, void *), void *arg) {
+	switch (DISK_BLOCK_SIZE(disk)) {
+		case 1024:
+			inode_block_foreach_kernel(disk, inode, 1024, callback, arg);
+			break;
+		case 2048:
+			inode_block_foreach_kernel(disk, inode, 2048, callback, arg);
+			break;
+		case 4096:
+			inode_block_foreach_kernel(disk, inode, 4096, callback, arg);
+			break;
+	}
+}
+
+
+struct inode_block_foreach_helper_arg {
+	void (*callback)(unsigned char *, unsigned int, unsigned int, void *);
+	void *arg;
+};
+
+
+static void inode_block_foreach_helper(unsigned char *disk, unsigned int inode, unsigned int n, unsigned int block, void *arg) {
+	struct inode_block_foreach_helper_arg *helper_arg = arg;
+	(*helper_arg->callback)(disk, inode, block, helper_arg->arg);
+}
+
+
+void inode_block_foreach(unsigned char *disk, unsigned int inode, void (*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg) {
+	struct inode_block_foreach_helper_arg helper_arg;
+	helper_arg.callback = callback;
+	helper_arg.arg = arg;
+
+	switch (DISK_BLOCK_SIZE(disk)) {
+		case 1024:
+			inode_block_foreach_kernel(disk, inode, 1024, &inode_block_foreach_helper, &helper_arg);
+			break;
+		case 2048:
+			inode_block_foreach_kernel(disk, inode, 2048, &inode_block_foreach_helper, &helper_arg);
+			break;
+		case 4096:
+			inode_block_foreach_kernel(disk, inode, 4096, &inode_block_foreach_helper, &helper_arg);
+			break;
+	}
+}
+
+
+void inode_indirect_block_foreach(unsigned char *disk, unsigned int inode, void (*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg) {
+	const unsigned int nblocks = DISK_BLOCK_SIZE(disk) / sizeof (unsigned int);
+	struct ext2_inode *inode_entry = inode_from_index(disk, inode);
+	unsigned int *i_block = inode_entry->i_block;
+	unsigned int *ib2, *ib3;
+
+	// Short symbolic link targets are kept in place of the block numbers.
+	if (S_ISLNK(inode_entry->i_mode) && inode_entry->i_blocks == 0) {
+		return;
+	}
+
+	// A zero block number is a hole in a sparse file, the pointers after it can still be set.
+	if (i_block[12]) {
+		(*callback)(disk, inode, BLOCK_INDEX(disk, i_block[12]), arg);
+	}
+
+	if (i_block[13]) {
+		(*callback)(disk, inode, BLOCK_INDEX(disk, i_block[13]), arg);
+		ib2 = (unsigned int *) DISK_BLOCK(disk, i_block[13]);
+		for (unsigned int i = 0; i < nblocks; i++) {
+			if (!ib2[i]) {
+				continue;
+			}
+			(*callback)(disk, inode, BLOCK_INDEX(disk, ib2[i]), arg);
+		}
+	}
+
+	if (i_block[14]) {
+		(*callback)(disk, inode, BLOCK_INDEX(disk, i_block[14]), arg);
+		ib3 = (unsigned int *) DISK_BLOCK(disk, i_block[14]);
+		for (unsigned int i = 0; i < nblocks; i++) {
+			if (!ib3[i]) {
+				continue;
+			}
+			(*callback)(disk, inode, BLOCK_INDEX(disk, ib3[i]), arg);
+			ib2 = (unsigned int *) DISK_BLOCK(disk, ib3[i]);
+			for (unsigned int j = 0; j < nblocks; j++) {
+				if (!ib2[j]) {
+					continue;
 				}
+				(*callback)(disk, inode, BLOCK_INDEX(disk, ib2[j]), arg);
 			}
-		} else {
+		}
+	}
+}
+
+
+/**
+ * Calls the callback for each datablock in a table of block numbers until one of them returns a
+ * directory entry, sets hole and stops at the first hole.
+ */
+static inline __attribute__((always_inline)) struct ext2_dir_entry *block_table_find(unsigned char *disk, unsigned int inode, unsigned int *iblocks_tbl, unsigned int nblocks, bool *hole, struct ext2_dir_entry *(*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg) {
+	for (unsigned int i = 0; i < nblocks; i++) {
+		if (!iblocks_tbl[i]) {
+			*hole = true;
 			return NULL;
 		}
+		struct ext2_dir_entry *dir_entry = (*callback)(disk, inode, iblocks_tbl[i], arg);
+		if (dir_entry != NULL) {
+			return dir_entry;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Same walk as inode_block_foreach_kernel, but returns as soon as the callback finds an entry.
+ */
+static inline __attribute__((always_inline)) struct ext2_dir_entry *inode_dir_entry_find_kernel(unsigned char *disk, unsigned int inode, const unsigned int block_size, struct ext2_dir_entry *(*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg) {
+	const unsigned int nblocks = block_size / sizeof (unsigned int);
+	struct ext2_inode *inode_entry = inode_from_index(disk, inode);
+	unsigned int *i_block = inode_entry->i_block;
+	unsigned int *ib1, *ib2, *ib3;
+	struct ext2_dir_entry *dir_entry;
+	bool hole = false;
+
+	if ((dir_entry = block_table_find(disk, inode, i_block, 12, &hole, callback, arg)) || hole || !i_block[12]) {
+		return dir_entry;
+	}
+	ib1 = (unsigned int *)(disk + (size_t) block_size * i_block[12]);
+	if ((dir_entry = block_table_find(disk, inode, ib1, nblocks, &hole, callback, arg)) || hole || !i_block[13]) {
+		return dir_entry;
+	}
+
+	ib2 = (unsigned int *)(disk + (size_t) block_size * i_block[13]);
+	for (unsigned int i = 0; i < nblocks; i++) {
+		if (!ib2[i]) return NULL;
+		ib1 = (unsigned int *)(disk + (size_t) block_size * ib2[i]);
+		if ((dir_entry = block_table_find(disk, inode, ib1, nblocks, &hole, callback, arg)) || hole) return dir_entry;
+	}
+	if (!i_block[14]) {
+		return NULL;
+	}
+
+	ib3 = (unsigned int *)(disk + (size_t) block_size * i_block[14]);
+	for (unsigned int i = 0; i < nblocks; i++) {
+		if (!ib3[i]) return NULL;
+		ib2 = (unsigned int *)(disk + (size_t) block_size * ib3[i]);
+		for (unsigned int j = 0; j < nblocks; j++) {
+			if (!ib2[j]) return NULL;
+			ib1 = (unsigned int *)(disk + (size_t) block_size * ib2[j]);
+			if ((dir_entry = block_table_find(disk, inode, ib1, nblocks, &hole, callback, arg)) || hole) return dir_entry;
+		}
 	}
 	return NULL;
 }
 
 
+struct ext2_dir_entry *inode_dir_entry_find(unsigned char *disk, unsigned int inode, struct ext2_dir_entry *(*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg) {
+	struct ext2_dir_entry *dir_entry = NULL;
+
+	switch (DISK_BLOCK_SIZE(disk)) {
+		case 1024:
+			dir_entry = inode_dir_entry_find_kernel(disk, inode, 1024, callback, arg);
+			break;
+		case 2048:
+			dir_entry = inode_dir_entry_find_kernel(disk, inode, 2048, callback, arg);
+			break;
+		case 4096:
+			dir_entry = inode_dir_entry_find_kernel(disk, inode, 4096, callback, arg);
+			break;
+	}
+
+	return dir_entry != NULL && dir_entry->inode ? dir_entry : NULL;
+}
+
+
 void inode_foreach(unsigned char *disk, void (*callback)(unsigned char *, unsigned int, void *), void *arg) {
 	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
-	for (unsigned int i = 0; i < super_block->s_inodes_count / 8; i++) {
-		for (unsigned int j = 0; j < 8; j++) {
-			unsigned int inode = i * 8 + j;
-			(*callback)(disk, inode, arg);
-		}
+	inode_range_foreach(disk, 0, super_block->s_inodes_count / 8 * 8, callback, arg);
+}
+
+
+void inode_range_foreach(unsigned char *disk, unsigned int first, unsigned int count, void (*callback)(unsigned char *, unsigned int, void *), void *arg) {
+	for (unsigned int inode = first; inode < first + count; inode++) {
+		(*callback)(disk, inode, arg);
 	}
 }
 
 
 void block_foreach(unsigned char *disk, void (*callback)(unsigned char *, unsigned int, void *), void *arg) {
 	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
-	for (unsigned int i = 0; i < super_block->s_blocks_count / 8; i++) {
-		for (unsigned int j = 0; j < 8; j++) {
-			unsigned int block = i * 8 + j;
-			(*callback)(disk, block, arg);
-		}
+	unsigned int blocks = super_block->s_blocks_count - super_block->s_first_data_block;
+	for (unsigned int block = 0; block < blocks; block++) {
+		(*callback)(disk, block, arg);
 	}
 }
 
@@ -145,12 +426,10 @@ unsigned int inode_find(unsigned char *disk, bool (*callback)(unsigned char *, u
 
 unsigned int block_find(unsigned char *disk, bool (*callback)(unsigned char *, unsigned int, void *), void *arg) {
 	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
-	for (unsigned int i = 0; i < super_block->s_blocks_count / 8; i++) {
-		for (unsigned int j = 0; j < 8; j++) {
-			unsigned int block = i * 8 + j;
-			if ((*callback)(disk, block, arg)) {
-				return block;
-			}
+	unsigned int blocks = super_block->s_blocks_count - super_block->s_first_data_block;
+	for (unsigned int block = 0; block < blocks; block++) {
+		if ((*callback)(disk, block, arg)) {
+			return block;
 		}
 	}
 	return -1;
@@ -161,15 +440,11 @@ void directory_entry_foreach(unsigned char *disk, unsigned int inode, void (*cal
 	struct ext2_inode *inode_entry = inode_from_index(disk, inode);
 
 	if (S_ISDIR(inode_entry->i_mode)) {
-		struct directory_entry_foreach_helper_arg *helper_arg = malloc(sizeof (struct directory_entry_foreach_helper_arg));
-		if (helper_arg == NULL) {
-			perror("malloc");
-			exit(EXIT_FAILURE);
-		}
-		helper_arg->arg = arg;
-		helper_arg->callback = callback;
+		struct directory_entry_foreach_helper_arg helper_arg;
+		helper_arg.arg = arg;
+		helper_arg.callback = callback;
 
-		inode_block_foreach(disk, inode, &directory_entry_foreach_helper, helper_arg);
+		inode_block_foreach(disk, inode, &directory_entry_foreach_helper, &helper_arg);
 	}
 }
 
@@ -178,10 +453,11 @@ void directory_entry_foreach_helper(unsigned char *disk, unsigned int inode, uns
 	struct directory_entry_foreach_helper_arg *helper_arg = arg;
 	void (*callback)(unsigned char *, struct ext2_dir_entry *, void *) = helper_arg->callback;
 	
-	struct ext2_dir_entry *dir_entry = dir_entry_from_index(disk, block + 1);
-	int total = 0;
+	struct ext2_dir_entry *dir_entry = dir_entry_from_index(disk, BLOCK_NUMBER(disk, block));
+	unsigned int block_size = DISK_BLOCK_SIZE(disk);
+	unsigned int total = 0;
 
-	while (total < EXT2_BLOCK_SIZE) {
+	while (total < block_size) {
 		(*callback)(disk, dir_entry, helper_arg->arg);
 		
 		total += dir_entry->rec_len;
@@ -192,38 +468,226 @@ void directory_entry_foreach_helper(unsigned char *disk, unsigned int inode, uns
 
 bool is_inode_free(unsigned char *disk, unsigned int inode) {
 	if (is_inode_reserved(inode)) return false;
-	unsigned char *inode_bitmap = DISK_INODE_BITMAP(disk);
-	unsigned short index = inode / 8;
-	unsigned short offset = inode % 8;
-	return !(1 & inode_bitmap[index] >> offset);
+	unsigned char *inode_bitmap = DISK_INODE_BITMAP(disk, INODE_GROUP(disk, inode));
+	return !is_bit_set_by_index(inode_bitmap, INODE_GROUP_INDEX(disk, inode));
 }
 
 
 bool is_block_free(unsigned char *disk, unsigned int block) {
-	unsigned char *block_bitmap = DISK_BLOCK_BITMAP(disk);
-	unsigned short index = block / 8;
-	unsigned short offset = block % 8;
-	return !(1 & block_bitmap[index] >> offset);
+	unsigned char *block_bitmap = DISK_BLOCK_BITMAP(disk, BLOCK_GROUP(disk, block));
+	return !is_bit_set_by_index(block_bitmap, BLOCK_GROUP_INDEX(disk, block));
 }
 
 
 unsigned int next_free_inode(unsigned char *disk) {
-	return inode_find(disk, &next_free_inode_helper, NULL);
+	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
+	unsigned int inodes_per_group = super_block->s_inodes_per_group;
+
+	for (unsigned int group = INODE_GROUP(disk, inode_cursor); inode_cursor < super_block->s_inodes_count; group++) {
+		unsigned int start = inode_cursor - group * inodes_per_group;
+		unsigned int index = bitmap_find_zero(DISK_INODE_BITMAP(disk, group), start, inodes_per_group);
+		if (index != -1) {
+			inode_cursor = group * inodes_per_group + index;
+			return inode_cursor;
+		}
+		inode_cursor = (group + 1) * inodes_per_group;
+	}
+
+	return -1;
+}
+
+
+/**
+ * Reserved block runs, free in the bitmaps but skipped by the allocators so that whoever reserved
+ * them can take them later. They only live in memory, so a tool that exits or crashes leaves
+ * nothing behind on the disk.
+ */
+static struct block_run **reserved_runs = NULL;
+static unsigned int reserved_runs_count = 0;
+static unsigned int reserved_runs_size = 0;
+
+
+/**
+ * Reserves the blocks of the run until unreserve_block_run is called with it.
+ */
+static void reserve_block_run(struct block_run *run) {
+	if (reserved_runs_count == reserved_runs_size) {
+		reserved_runs_size = reserved_runs_size ? reserved_runs_size * 2 : 16;
+		reserved_runs = realloc(reserved_runs, reserved_runs_size * sizeof (struct block_run *));
+		if (reserved_runs == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	reserved_runs[reserved_runs_count++] = run;
+}
+
+
+/**
+ * Gives the blocks of the run back to the allocators and empties it.
+ */
+static void unreserve_block_run(struct block_run *run) {
+	for (unsigned int i = 0; i < reserved_runs_count; i++) {
+		if (reserved_runs[i] == run) {
+			reserved_runs[i] = reserved_runs[--reserved_runs_count];
+			break;
+		}
+	}
+	if (run->len > 0 && run->start < block_cursor) {
+		block_cursor = run->start;
+	}
+	run->len = 0;
 }
 
 
-bool next_free_inode_helper(unsigned char *disk, unsigned int inode, void *arg) {
-	return is_inode_free(disk, inode);
+/**
+ * Returns the start of the first reserved run that ends after block, or -1 if there is none, and
+ * stores where it ends in end.
+ */
+static unsigned int reserved_block_run_after(unsigned int block, unsigned int *end) {
+	unsigned int start = -1;
+	*end = -1;
+	for (unsigned int i = 0; i < reserved_runs_count; i++) {
+		struct block_run *run = reserved_runs[i];
+		if (run->start + run->len > block && run->start < start) {
+			start = run->start;
+			*end = run->start + run->len;
+		}
+	}
+	return start;
 }
 
 
 unsigned int next_free_block(unsigned char *disk) {
-	return block_find(disk, &next_free_block_helper, NULL);
+	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
+	unsigned int blocks_per_group = super_block->s_blocks_per_group;
+	unsigned int blocks = super_block->s_blocks_count - super_block->s_first_data_block;
+
+	for (unsigned int group = BLOCK_GROUP(disk, block_cursor); block_cursor < blocks; group++) {
+		unsigned int nbits = group_blocks_count(disk, group);
+		unsigned int start = block_cursor - group * blocks_per_group;
+		unsigned int index;
+		while (start < nbits && (index = bitmap_find_zero(DISK_BLOCK_BITMAP(disk, group), start, nbits)) != -1) {
+			unsigned int block = group * blocks_per_group + index;
+			unsigned int end;
+			if (reserved_block_run_after(block, &end) > block) {
+				block_cursor = block;
+				return block_cursor;
+			}
+			start = end - group * blocks_per_group;
+		}
+		block_cursor = (group + 1) * blocks_per_group;
+	}
+
+	return -1;
+}
+
+
+/**
+ * Returns how many free and unreserved blocks, up to count, there are in a row from goal, without
+ * crossing into the next group.
+ */
+static unsigned int free_run_at(unsigned char *disk, unsigned int goal, unsigned int count) {
+	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
+	unsigned int blocks = super_block->s_blocks_count - super_block->s_first_data_block;
+	unsigned int reserved_end;
+
+	if (goal >= blocks || !is_block_free(disk, goal)) {
+		return 0;
+	}
+	unsigned int reserved = reserved_block_run_after(goal, &reserved_end);
+	if (reserved <= goal) {
+		return 0;
+	}
+	unsigned int group = BLOCK_GROUP(disk, goal);
+	unsigned int nbits = group_blocks_count(disk, group);
+	unsigned int end = bitmap_find_set(DISK_BLOCK_BITMAP(disk, group), BLOCK_GROUP_INDEX(disk, goal), nbits);
+	return MIN(MIN((end == -1 ? nbits : end) - BLOCK_GROUP_INDEX(disk, goal), reserved - goal), count);
+}
+
+
+/**
+ * Marks the len blocks from start, all in one group, as used.
+ */
+static void mark_block_run_used(unsigned char *disk, unsigned int start, unsigned int len) {
+	unsigned int group = BLOCK_GROUP(disk, start);
+	bitmap_set_range(DISK_BLOCK_BITMAP(disk, group), BLOCK_GROUP_INDEX(disk, start), len);
+	DISK_SUPER_BLOCK(disk)->s_free_blocks_count -= len;
+	DISK_GROUP_DESC(disk, group)->bg_free_blocks_count -= len;
+}
+
+
+unsigned int new_block_run(unsigned char *disk, unsigned int goal, unsigned int count, unsigned int *run_len) {
+	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
+	unsigned int blocks_per_group = super_block->s_blocks_per_group;
+	unsigned int blocks = super_block->s_blocks_count - super_block->s_first_data_block;
+	unsigned int start = goal;
+	unsigned int len = free_run_at(disk, goal, count);
+
+	// First run of count free blocks, otherwise the longest run, runs do not cross groups.
+	for (unsigned int group = BLOCK_GROUP(disk, block_cursor); len < count && group * blocks_per_group < blocks; group++) {
+		unsigned char *bitmap = DISK_BLOCK_BITMAP(disk, group);
+		unsigned int nbits = group_blocks_count(disk, group);
+		unsigned int index = group == BLOCK_GROUP(disk, block_cursor) ? BLOCK_GROUP_INDEX(disk, block_cursor) : 0;
+
+		while (len < count && index < nbits && (index = bitmap_find_zero(bitmap, index, nbits)) != -1) {
+			unsigned int end = bitmap_find_set(bitmap, index, nbits);
+			if (end == -1) {
+				end = nbits;
+			}
+
+			// Reserved blocks are skipped over, and cut the free blocks before them short.
+			unsigned int reserved_end;
+			unsigned int reserved = reserved_block_run_after(group * blocks_per_group + index, &reserved_end);
+			if (reserved <= group * blocks_per_group + index) {
+				index = reserved_end - group * blocks_per_group;
+				continue;
+			}
+			end = MIN(end, reserved - group * blocks_per_group);
+
+			if (end - index > len) {
+				start = group * blocks_per_group + index;
+				len = MIN(end - index, count);
+			}
+			index = end;
+		}
+	}
+
+	if (len == 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	mark_block_run_used(disk, start, len);
+	*run_len = len;
+	return start;
+}
+
+
+unsigned int new_block_from_run(unsigned char *disk, struct block_run *run, unsigned int remaining) {
+	if (run->len == 0) {
+		unsigned int goal = run->start;
+		run->start = new_block_run(disk, goal, remaining, &run->len);
+		if (run->start == -1) {
+			return -1;
+		}
+	}
+	run->len--;
+	return run->start++;
+}
+
+
+void rm_block_run(unsigned char *disk, struct block_run *run) {
+	for (; run->len > 0; run->len--) {
+		rm_block(disk, run->start++);
+	}
 }
 
 
-bool next_free_block_helper(unsigned char *disk, unsigned int block, void *arg) {
-	return is_block_free(disk, block);
+unsigned int group_blocks_count(unsigned char *disk, unsigned int group) {
+	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
+	unsigned int blocks = super_block->s_blocks_count - super_block->s_first_data_block;
+	return MIN(super_block->s_blocks_per_group, blocks - group * super_block->s_blocks_per_group);
 }
 
 
@@ -280,8 +744,11 @@ char *shift_filepath(char **abspath) {
 	int i = 0;
 	for (; (*abspath)[i] != '/' && (*abspath)[i] != '\0'; i++);
 	if (filename[0] != '\0' && ((*abspath)[i] == '/' || (*abspath)[i] == '\0')) {
-		(*abspath)[i] = '\0';
-		*abspath += i + 1;
+		if ((*abspath)[i] == '/') {
+			(*abspath)[i] = '\0';
+			i++;
+		}
+		*abspath += i;
 		return filename;
 	}  else {
 		return NULL;
@@ -296,91 +763,333 @@ unsigned int inode_by_filepath(unsigned char *disk, char *abspath) {
 		exit(EXIT_FAILURE);
 	}
 	strcpy(abspath_clone, abspath);
+	char *rest = abspath_clone;
 
 	unsigned int inode = EXT2_ROOT_INO - 1;
 	struct ext2_inode *inode_entry = inode_from_index(disk, inode);
 	
 	char *filename = NULL;
-	while ((filename = shift_filepath(&abspath_clone))) {
+	while ((filename = shift_filepath(&rest))) {
 		if (S_ISDIR(inode_entry->i_mode)) {
-			struct ext2_dir_entry *dir_entry = inode_dir_entry_find(disk, inode, &inode_by_filepath_helper, filename);
-			if (dir_entry == NULL) return -1;
-			inode = dir_entry->inode - 1;
+			unsigned int child_inode = dir_inode_by_name(disk, inode, filename);
+			if (child_inode == -1) {
+				inode = -1;
+				break;
+			}
+			inode = child_inode;
 			inode_entry = inode_from_index(disk, inode);
-		} else if (!S_ISDIR(inode_entry->i_mode) && abspath_clone[0] != '\0') {
-			return -1;
+		} else if (!S_ISDIR(inode_entry->i_mode) && rest[0] != '\0') {
+			inode = -1;
+			break;
 		}
 	}
 
+	free(abspath_clone);
 	return inode;
 }
 
 
+unsigned int dir_inode_by_name(unsigned char *disk, unsigned int inode, char *filename) {
+	unsigned int child_inode;
+	if (dentry_cache_lookup(inode, filename, &child_inode)) {
+		return child_inode;
+	}
+
+	if (dentry_indexed != NULL && is_bit_set_by_index(dentry_indexed, inode)) {
+		return -1;
+	}
+
+	struct ext2_inode *inode_entry = inode_from_index(disk, inode);
+	if (inode_entry->i_size / DISK_BLOCK_SIZE(disk) >= DENTRY_INDEX_MIN_BLOCKS) {
+		dentry_index_directory(disk, inode);
+		return dentry_cache_lookup(inode, filename, &child_inode) ? child_inode : -1;
+	}
+
+	struct ext2_dir_entry *dir_entry = inode_dir_entry_find(disk, inode, &inode_by_filepath_helper, filename);
+	child_inode = dir_entry != NULL ? dir_entry->inode - 1 : -1;
+	dentry_cache_insert(inode, filename, child_inode);
+	return child_inode;
+}
+
+
 struct ext2_dir_entry *inode_by_filepath_helper(unsigned char *disk, unsigned int inode, unsigned int block, void *arg) {
 	char *filename = arg;
 	struct ext2_dir_entry *dir_entry = dir_entry_from_index(disk, block);
-	struct ext2_dir_entry *found = dir_entry_by_name(dir_entry, filename);
+	struct ext2_dir_entry *found = dir_entry_by_name(disk, dir_entry, filename);
 	return found;
 }
 
 
-struct ext2_dir_entry *dir_entry_by_name(struct ext2_dir_entry *dir_entry, char *filename) {
-	int total = 0;
-	size_t filename_len = strlen(filename);
+static unsigned int dentry_hash(unsigned int parent, char *name, size_t name_len) {
+	// FNV-1a over the parent inode followed by the name.
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < sizeof (unsigned int); i++) {
+		hash = (hash ^ ((parent >> (i * 8)) & 0xff)) * 16777619u;
+	}
+	for (size_t i = 0; i < name_len; i++) {
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+	}
+	return hash;
+}
 
-	while (total < EXT2_BLOCK_SIZE) {
-		if (filename_len == dir_entry->name_len && strncmp(filename, dir_entry->name, dir_entry->name_len) == 0) {
-			return dir_entry;
-		}
 
-		total += dir_entry->rec_len;
-		dir_entry = (void *) dir_entry + dir_entry->rec_len;
+static struct dentry **dentry_slot(unsigned int parent, char *name, size_t name_len) {
+	struct dentry **slot = &dentry_table[dentry_hash(parent, name, name_len) & (dentry_table_size - 1)];
+	while (*slot != NULL && !(
+		(*slot)->parent == parent
+		&& (*slot)->name_len == name_len
+		&& memcmp((*slot)->name, name, name_len) == 0
+	)) {
+		slot = &(*slot)->next;
 	}
-
-	return NULL;
+	return slot;
 }
 
 
-struct ext2_dir_entry *dir_entry_before_name(struct ext2_dir_entry *dir_entry, char *filename) {
-	int total = 0;
-	size_t filename_len = strlen(filename);
-	struct ext2_dir_entry *prev_dir_entry = dir_entry;
+static void dentry_table_grow(void) {
+	unsigned int size = dentry_table_size ? dentry_table_size * 2 : 256;
+	struct dentry **table = calloc(size, sizeof (struct dentry *));
+	if (table == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
 
-	while (total < EXT2_BLOCK_SIZE) {
-		if (filename_len == dir_entry->name_len && strncmp(filename, dir_entry->name, dir_entry->name_len) == 0) {
-			return prev_dir_entry;
+	for (unsigned int i = 0; i < dentry_table_size; i++) {
+		struct dentry *dentry = dentry_table[i];
+		while (dentry != NULL) {
+			struct dentry *next = dentry->next;
+			unsigned int bucket = dentry_hash(dentry->parent, dentry->name, dentry->name_len) & (size - 1);
+			dentry->next = table[bucket];
+			table[bucket] = dentry;
+			dentry = next;
 		}
-		prev_dir_entry = dir_entry;
-
-		total += dir_entry->rec_len;
-		dir_entry = (void *) dir_entry + dir_entry->rec_len;
 	}
 
-	return NULL;
+	free(dentry_table);
+	dentry_table = table;
+	dentry_table_size = size;
 }
 
 
-void set_bit_by_index(unsigned char *bitmap, unsigned int n) {
-	unsigned short index = n / 8;
-	unsigned short offset = n % 8;
-	*(bitmap + index) |= 1 << offset;
-}
+bool dentry_cache_lookup(unsigned int parent, char *name, unsigned int *inode) {
+	if (dentry_table == NULL) {
+		return false;
+	}
+
+	struct dentry *dentry = *dentry_slot(parent, name, strlen(name));
+	if (dentry == NULL) {
+		return false;
+	}
+
+	*inode = dentry->inode;
+	return true;
+}
+
+
+static void dentry_insert(unsigned int parent, char *name, size_t name_len, unsigned int inode) {
+	if (dentry_count >= dentry_table_size) {
+		dentry_table_grow();
+	}
+
+	struct dentry **slot = dentry_slot(parent, name, name_len);
+	if (*slot == NULL) {
+		struct dentry *dentry = malloc(sizeof (struct dentry) + name_len);
+		if (dentry == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		dentry->next = NULL;
+		dentry->parent = parent;
+		dentry->name_len = name_len;
+		memcpy(dentry->name, name, name_len);
+		*slot = dentry;
+		dentry_count++;
+	}
+	(*slot)->inode = inode;
+}
+
+
+void dentry_cache_insert(unsigned int parent, char *name, unsigned int inode) {
+	size_t name_len = strlen(name);
+	if (name_len > EXT2_NAME_LEN) {
+		return;
+	}
+	dentry_insert(parent, name, name_len, inode);
+}
+
+
+static void dentry_index_directory_helper(unsigned char *disk, struct ext2_dir_entry *dir_entry, void *arg) {
+	unsigned int *parent = arg;
+	if (dir_entry->inode != 0) {
+		dentry_insert(*parent, dir_entry->name, dir_entry->name_len, dir_entry->inode - 1);
+	}
+}
+
+
+void dentry_index_directory(unsigned char *disk, unsigned int inode) {
+	if (dentry_indexed == NULL) {
+		dentry_indexed = calloc(DISK_SUPER_BLOCK(disk)->s_inodes_count / 8 + 1, sizeof (unsigned char));
+		if (dentry_indexed == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	directory_entry_foreach(disk, inode, &dentry_index_directory_helper, &inode);
+	set_bit_by_index(dentry_indexed, inode);
+}
+
+
+struct ext2_dir_entry *dir_entry_by_name(unsigned char *disk, struct ext2_dir_entry *dir_entry, char *filename) {
+	unsigned int block_size = DISK_BLOCK_SIZE(disk);
+	unsigned int total = 0;
+	size_t filename_len = strlen(filename);
+
+	while (total < block_size) {
+		if (filename_len == dir_entry->name_len && strncmp(filename, dir_entry->name, dir_entry->name_len) == 0) {
+			return dir_entry;
+		}
+
+		total += dir_entry->rec_len;
+		dir_entry = (void *) dir_entry + dir_entry->rec_len;
+	}
+
+	return NULL;
+}
+
+
+struct ext2_dir_entry *dir_entry_before_name(unsigned char *disk, struct ext2_dir_entry *dir_entry, char *filename) {
+	unsigned int block_size = DISK_BLOCK_SIZE(disk);
+	unsigned int total = 0;
+	size_t filename_len = strlen(filename);
+	struct ext2_dir_entry *prev_dir_entry = dir_entry;
+
+	while (total < block_size) {
+		if (filename_len == dir_entry->name_len && strncmp(filename, dir_entry->name, dir_entry->name_len) == 0) {
+			return prev_dir_entry;
+		}
+		prev_dir_entry = dir_entry;
+
+		total += dir_entry->rec_len;
+		dir_entry = (void *) dir_entry + dir_entry->rec_len;
+	}
+
+	return NULL;
+}
+
+
+void set_bit_by_index(unsigned char *bitmap, unsigned int n) {
+	unsigned int index = n / 8;
+	unsigned int offset = n % 8;
+	*(bitmap + index) |= 1 << offset;
+}
 
 
 void unset_bit_by_index(unsigned char *bitmap, unsigned int n) {
-	unsigned short index = n / 8;
-	unsigned short offset = n % 8;
+	unsigned int index = n / 8;
+	unsigned int offset = n % 8;
 	*(bitmap + index) &= ~(1 << offset);
 }
 
 
 bool is_bit_set_by_index(unsigned char *bitmap, unsigned int n) {
-	unsigned short index = n / 8;
-	unsigned short offset = n % 8;
+	unsigned int index = n / 8;
+	unsigned int offset = n % 8;
 	return 1 & (*(bitmap + index) >> offset);
 }
 
 
+/**
+ * Loads the nth 64 bit word of a bitmap of nbits bits, bytes past the end of the bitmap read as
+ * all ones. Bitmaps are little endian, like the rest of the on-disk structures, so bit i of the
+ * word is bit (n * 64 + i) of the bitmap.
+ */
+static inline uint64_t bitmap_word(unsigned char *bitmap, unsigned int n, unsigned int nbits) {
+	unsigned int nbytes = (nbits + 7) / 8;
+	uint64_t word = ~(uint64_t) 0;
+	memcpy(&word, bitmap + n * 8, MIN(nbytes - n * 8, sizeof (uint64_t)));
+	return word;
+}
+
+
+unsigned int bitmap_find_set(unsigned char *bitmap, unsigned int start, unsigned int nbits) {
+	unsigned int nwords = (nbits + 63) / 64;
+
+	for (unsigned int n = start / 64; n < nwords; n++) {
+		uint64_t word = bitmap_word(bitmap, n, nbits);
+		if (n == start / 64) {
+			word &= ~(((uint64_t) 1 << (start % 64)) - 1);
+		}
+		if (word) {
+			unsigned int bit = n * 64 + __builtin_ctzll(word);
+			return bit < nbits ? bit : -1;
+		}
+	}
+
+	return -1;
+}
+
+
+void bitmap_set_range(unsigned char *bitmap, unsigned int start, unsigned int len) {
+	unsigned int end = start + len;
+
+	for (; start < end && start % 8; start++) {
+		set_bit_by_index(bitmap, start);
+	}
+	if (start + 8 <= end) {
+		memset(bitmap + start / 8, 0xff, (end - start) / 8);
+		start += (end - start) / 8 * 8;
+	}
+	for (; start < end; start++) {
+		set_bit_by_index(bitmap, start);
+	}
+}
+
+
+unsigned int bitmap_count_set(unsigned char *bitmap, unsigned int nbits) {
+	unsigned int nfull = nbits / 64;
+	unsigned int count0 = 0, count1 = 0, count2 = 0, count3 = 0;
+	unsigned int n = 0;
+
+	// Four independent sums so consecutive popcounts do not wait on each other.
+	for (; n + 4 <= nfull; n += 4) {
+		uint64_t words[4];
+		memcpy(words, bitmap + n * 8, sizeof words);
+		count0 += __builtin_popcountll(words[0]);
+		count1 += __builtin_popcountll(words[1]);
+		count2 += __builtin_popcountll(words[2]);
+		count3 += __builtin_popcountll(words[3]);
+	}
+	for (; n < nfull; n++) {
+		count0 += __builtin_popcountll(bitmap_word(bitmap, n, nbits));
+	}
+	if (nbits % 64) {
+		// Only the low bits of the last word belong to the bitmap.
+		count0 += __builtin_popcountll(bitmap_word(bitmap, n, nbits) & (((uint64_t) 1 << (nbits % 64)) - 1));
+	}
+
+	return count0 + count1 + count2 + count3;
+}
+
+
+unsigned int bitmap_find_zero(unsigned char *bitmap, unsigned int start, unsigned int nbits) {
+	unsigned int nwords = (nbits + 63) / 64;
+
+	for (unsigned int n = start / 64; n < nwords; n++) {
+		uint64_t word = bitmap_word(bitmap, n, nbits);
+		if (n == start / 64) {
+			word |= ((uint64_t) 1 << (start % 64)) - 1;
+		}
+		if (~word) {
+			unsigned int bit = n * 64 + __builtin_ctzll(~word);
+			return bit < nbits ? bit : -1;
+		}
+	}
+
+	return -1;
+}
+
+
 unsigned int new_inode(unsigned char *disk) {
 	unsigned int inode = next_free_inode(disk);
 	if (inode == -1) {
@@ -388,13 +1097,7 @@ unsigned int new_inode(unsigned char *disk) {
 		return -1;
 	}
 
-	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
-	struct ext2_group_desc *group_desc = DISK_GROUP_DESC(disk);
-	unsigned char *inode_bitmap = DISK_INODE_BITMAP(disk);
-
-	set_bit_by_index(inode_bitmap, inode);
-	super_block->s_free_inodes_count--;
-	group_desc->bg_free_inodes_count--;
+	mark_inode_used(disk, inode);
 
 	return inode;
 }
@@ -406,38 +1109,66 @@ unsigned int new_block(unsigned char *disk) {
 		errno = ENOSPC;
 		return -1;
 	}
-		
-	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
-	struct ext2_group_desc *group_desc = DISK_GROUP_DESC(disk);
-	unsigned char *block_bitmap = DISK_BLOCK_BITMAP(disk);
 
-	set_bit_by_index(block_bitmap, block);
-	super_block->s_free_blocks_count--;
-	group_desc->bg_free_blocks_count--;
+	mark_block_used(disk, block);
 
 	return block;
 }
 
 
 void rm_inode(unsigned char *disk, unsigned int inode) {
+	unsigned int group = INODE_GROUP(disk, inode);
 	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
-	struct ext2_group_desc *group_desc = DISK_GROUP_DESC(disk);
-	unsigned char *inode_bitmap = DISK_INODE_BITMAP(disk);
+	struct ext2_group_desc *group_desc = DISK_GROUP_DESC(disk, group);
+	unsigned char *inode_bitmap = DISK_INODE_BITMAP(disk, group);
 
-	unset_bit_by_index(inode_bitmap, inode);
+	unset_bit_by_index(inode_bitmap, INODE_GROUP_INDEX(disk, inode));
 	super_block->s_free_inodes_count++;
 	group_desc->bg_free_inodes_count++;
+
+	if (inode < inode_cursor && !is_inode_reserved(inode)) {
+		inode_cursor = inode;
+	}
 }
 
 
 void rm_block(unsigned char *disk, unsigned int block) {
+	unsigned int group = BLOCK_GROUP(disk, block);
 	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
-	struct ext2_group_desc *group_desc = DISK_GROUP_DESC(disk);
-	unsigned char *block_bitmap = DISK_BLOCK_BITMAP(disk);
+	struct ext2_group_desc *group_desc = DISK_GROUP_DESC(disk, group);
+	unsigned char *block_bitmap = DISK_BLOCK_BITMAP(disk, group);
 
-	unset_bit_by_index(block_bitmap, block);
+	unset_bit_by_index(block_bitmap, BLOCK_GROUP_INDEX(disk, block));
 	super_block->s_free_blocks_count++;
 	group_desc->bg_free_blocks_count++;
+
+	if (block < block_cursor) {
+		block_cursor = block;
+	}
+}
+
+
+void mark_inode_used(unsigned char *disk, unsigned int inode) {
+	unsigned int group = INODE_GROUP(disk, inode);
+	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
+	struct ext2_group_desc *group_desc = DISK_GROUP_DESC(disk, group);
+	unsigned char *inode_bitmap = DISK_INODE_BITMAP(disk, group);
+
+	set_bit_by_index(inode_bitmap, INODE_GROUP_INDEX(disk, inode));
+	super_block->s_free_inodes_count--;
+	group_desc->bg_free_inodes_count--;
+}
+
+
+void mark_block_used(unsigned char *disk, unsigned int block) {
+	unsigned int group = BLOCK_GROUP(disk, block);
+	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
+	struct ext2_group_desc *group_desc = DISK_GROUP_DESC(disk, group);
+	unsigned char *block_bitmap = DISK_BLOCK_BITMAP(disk, group);
+
+	set_bit_by_index(block_bitmap, BLOCK_GROUP_INDEX(disk, block));
+	super_block->s_free_blocks_count--;
+	group_desc->bg_free_blocks_count--;
 }
 
 
@@ -498,92 +1229,595 @@ unsigned int new_inode_link(unsigned char *disk) {
 }
 
 
-struct ext2_dir_entry *new_dir_entry(unsigned char *disk, unsigned int parent_inode, unsigned int child_inode, char *name, unsigned char file_type) {
-	size_t name_len = strlen(name);
+/**
+ * Returns a pointer to the block number of the nth datablock of the inode, allocating and zeroing
+ * any indirect block on the way that does not exist yet.
+ */
+static unsigned int *inode_block_slot(unsigned char *disk, struct ext2_inode *inode_entry, unsigned int n, struct block_run *run, unsigned int *remaining) {
+	unsigned int block_size = DISK_BLOCK_SIZE(disk);
+	unsigned int p = block_size / sizeof (unsigned int);
+	unsigned int *slot;
+	unsigned int level;
+
+	if (n < 12) {
+		return &inode_entry->i_block[n];
+	}
+	n -= 12;
+	if (n < p) {
+		slot = &inode_entry->i_block[12];
+		level = 1;
+	} else if ((n -= p) < p * p) {
+		slot = &inode_entry->i_block[13];
+		level = 2;
+	} else {
+		n -= p * p;
+		slot = &inode_entry->i_block[14];
+		level = 3;
+	}
 
-	struct ext2_inode *parent_inode_entry = inode_from_index(disk, parent_inode);
-	struct ext2_inode *child_inode_entry = inode_from_index(disk, child_inode);
-	unsigned int new_dir_entry_size = rec_len_boundary(sizeof(struct ext2_dir_entry) + name_len);
-	struct ext2_dir_entry *dir_entry = NULL;
-	unsigned short rec_len = 0;
-
-	unsigned int i = parent_inode_entry->i_blocks / 2;
-	if (i > 0) {
-		i--;
-		if (i < 12) {
-			dir_entry = dir_entry_from_index(disk, parent_inode_entry->i_block[i]);
-			for (unsigned int total = 0; total + dir_entry->rec_len < EXT2_BLOCK_SIZE; total += dir_entry->rec_len) {
-				dir_entry = (void *) dir_entry + dir_entry->rec_len;
-			}
-			
-			unsigned int dir_entry_size = rec_len_boundary(sizeof(struct ext2_dir_entry) + dir_entry->name_len);
-			unsigned int padding = dir_entry->rec_len - dir_entry_size;
-			if (new_dir_entry_size <= padding) {
-				dir_entry->rec_len = dir_entry_size;
-				rec_len = padding;
+	for (unsigned int span = level == 3 ? p * p : level == 2 ? p : 1; level > 0; level--, span /= p) {
+		if (!*slot) {
+			unsigned int block = new_block_from_run(disk, run, (*remaining)--);
+			if (block == -1) {
+				return NULL;
 			}
+			memset(DISK_BLOCK(disk, BLOCK_NUMBER(disk, block)), 0, block_size);
+			inode_entry->i_blocks += block_size / 512;
+			*slot = BLOCK_NUMBER(disk, block);
+		}
+		slot = (unsigned int *) DISK_BLOCK(disk, *slot) + (n / span) % p;
+	}
+
+	return slot;
+}
+
+
+/**
+ * Allocates the nth datablock of the inode and returns a pointer to it in the disk.
+ */
+static unsigned char *inode_new_block(unsigned char *disk, struct ext2_inode *inode_entry, unsigned int n, struct block_run *run, unsigned int *remaining) {
+	unsigned int *slot = inode_block_slot(disk, inode_entry, n, run, remaining);
+	if (slot == NULL) {
+		return NULL;
+	}
+	// TODO: if (*slot != 0), then delete block
+	unsigned int block = new_block_from_run(disk, run, (*remaining)--);
+	if (block == -1) {
+		return NULL;
+	}
+	*slot = BLOCK_NUMBER(disk, block);
+	inode_entry->i_blocks += DISK_BLOCK_SIZE(disk) / 512;
+	return DISK_BLOCK(disk, *slot);
+}
+
+
+/**
+ * Takes the nth datablock out of the inode and frees it, along with each indirect block on the way
+ * that it leaves empty and that maps no datablock from limit on, which may still be allocated. A
+ * block right before the front of the run goes back to the run instead. Either way it counts as
+ * remaining again, since it may have to be allocated again.
+ * 
+ * When an allocation failed halfway, the datablock or the indirect blocks below some level may not
+ * exist, then only the ones that do and are empty are freed.
+ */
+static void inode_rm_block(unsigned char *disk, struct ext2_inode *inode_entry, unsigned int n, unsigned int limit, struct block_run *run, unsigned int *remaining) {
+	unsigned int block_size = DISK_BLOCK_SIZE(disk);
+	unsigned int p = block_size / sizeof (unsigned int);
+	unsigned int *slots[4];
+	unsigned int ends[3];  /* Where the datablocks that each indirect block maps end */
+	unsigned int first;
+	unsigned int level;
+
+	if (n < 12) {
+		slots[0] = &inode_entry->i_block[n];
+		first = 0;
+		level = 0;
+	} else if (n < 12 + p) {
+		slots[0] = &inode_entry->i_block[12];
+		first = 12;
+		level = 1;
+	} else if (n < 12 + p + p * p) {
+		slots[0] = &inode_entry->i_block[13];
+		first = 12 + p;
+		level = 2;
+	} else {
+		slots[0] = &inode_entry->i_block[14];
+		first = 12 + p + p * p;
+		level = 3;
+	}
+	n -= first;
+
+	// The slot of each indirect block on the way, down to the slot of the datablock.
+	unsigned int span = level == 3 ? p * p : level == 2 ? p : 1;
+	for (unsigned int i = 0; i < level; i++, span /= p) {
+		ends[i] = first + (n / (span * p) + 1) * (span * p);
+		if (!*slots[i]) {
+			level = i;
+			break;
+		}
+		slots[i + 1] = (unsigned int *) DISK_BLOCK(disk, *slots[i]) + (n / span) % p;
+	}
+
+	for (unsigned int i = level + 1; i-- > 0;) {
+		if (!*slots[i]) {
+			continue;
+		}
+		if (i < level && (ends[i] > limit || !is_zero(DISK_BLOCK(disk, *slots[i]), block_size))) {
+			break;
+		}
+		unsigned int block = BLOCK_INDEX(disk, *slots[i]);
+		*slots[i] = 0;
+		inode_entry->i_blocks -= block_size / 512;
+		(*remaining)++;
+		if (block + 1 == run->start) {
+			run->start--;
+			run->len++;
 		} else {
-			// TODO: handle indirection at i = 11
+			rm_block(disk, block);
+		}
+	}
+}
+
+
+/**
+ * Free space index of a directory, the largest gap a new entry can go in for each of its blocks. It
+ * is built the first time an entry is added to the directory, and kept up to date by
+ * new_dir_entry and rm_dir_entry.
+ * 
+ * The gaps are the leaves of a max tree, gaps[size + n] for the nth block and gaps[i] the largest
+ * of gaps[2 * i] and gaps[2 * i + 1] above them, so that updating a gap and finding the first
+ * block with room for an entry both take a logarithmic number of steps.
+ * 
+ * It also holds the preallocation window of the directory, free blocks right after its last one
+ * that are reserved for it, so that it can keep growing into them.
+ */
+struct dir_free_space {
+	struct dir_free_space *next;
+	unsigned int inode;
+	unsigned int nblocks;
+	unsigned int size;  /* Leaves in the tree, a power of two */
+	unsigned short *gaps;
+	struct block_run prealloc;
+};
+
+#define DIR_FREE_SPACE_BUCKETS 256
+
+/**
+ * Blocks a directory reserves past its end when it grows, if the super block does not say.
+ */
+#define DIR_PREALLOC_BLOCKS 8
+
+static struct dir_free_space *dir_free_space_table[DIR_FREE_SPACE_BUCKETS];
+
+
+/**
+ * Returns the bytes of its rec_len that the directory entry actually needs, none if it is unused.
+ * Unlike rec_len_boundary, a size that is already a multiple of 4 is not rounded up, since entries
+ * written by mke2fs, debugfs, or the kernel are packed that tightly.
+ */
+static unsigned short dir_entry_used_size(struct ext2_dir_entry *dir_entry) {
+	return dir_entry->inode ? (sizeof (struct ext2_dir_entry) + dir_entry->name_len + 3) & ~3 : 0;
+}
+
+
+/**
+ * Returns the size of the largest entry that fits in the directory block, either in the slack
+ * after a used entry or in place of an unused one.
+ */
+static unsigned short dir_block_gap(unsigned char *disk, struct ext2_dir_entry *dir_entry) {
+	unsigned int block_size = DISK_BLOCK_SIZE(disk);
+	unsigned short gap = 0;
+
+	for (unsigned int total = 0; total < block_size && dir_entry->rec_len; total += dir_entry->rec_len, dir_entry = (void *) dir_entry + dir_entry->rec_len) {
+		unsigned short used = dir_entry_used_size(dir_entry);
+		if (dir_entry->rec_len > used) {
+			gap = MAX(gap, dir_entry->rec_len - used);
 		}
 	}
 
-	if (rec_len == 0) {
-		int block = new_block(disk);
-		if (block == -1) {
-			return NULL;
+	return gap;
+}
+
+
+static void dir_free_space_set(struct dir_free_space *free_space, unsigned int n, unsigned short gap) {
+	while (n >= free_space->size) {
+		// The tree is doubled with the old leaves on the left, and every level above them rebuilt.
+		unsigned int size = free_space->size ? free_space->size * 2 : 16;
+		unsigned short *gaps = calloc(2 * size, sizeof (unsigned short));
+		if (gaps == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
 		}
-		parent_inode_entry->i_block[i] = block + 1;
-		parent_inode_entry->i_blocks += EXT2_BLOCK_SIZE / 512;
-		parent_inode_entry->i_size += 1024;
+		if (free_space->size) {
+			memcpy(gaps + size, free_space->gaps + free_space->size, free_space->size * sizeof (unsigned short));
+		}
+		for (unsigned int i = size - 1; i > 0; i--) {
+			gaps[i] = MAX(gaps[2 * i], gaps[2 * i + 1]);
+		}
+		free(free_space->gaps);
+		free_space->gaps = gaps;
+		free_space->size = size;
+	}
 
-		dir_entry = dir_entry_from_index(disk, parent_inode_entry->i_block[i]);
-		rec_len = EXT2_BLOCK_SIZE;
-	} else {
-		dir_entry = (void *) dir_entry + dir_entry->rec_len;
+	unsigned int i = free_space->size + n;
+	free_space->gaps[i] = gap;
+	for (i /= 2; i > 0; i /= 2) {
+		free_space->gaps[i] = MAX(free_space->gaps[2 * i], free_space->gaps[2 * i + 1]);
 	}
+	free_space->nblocks = MAX(free_space->nblocks, n + 1);
+}
 
-	if (rec_len > 0) {
-		strncpy(dir_entry->name, name, name_len);
-		dir_entry->name_len = name_len;
-		dir_entry->inode = child_inode + 1;
-		dir_entry->file_type = file_type;
-		dir_entry->rec_len = rec_len;
-		
-		child_inode_entry->i_links_count++;
-		return dir_entry;
+
+static void dir_free_space_build_helper(unsigned char *disk, unsigned int inode, unsigned int block, void *arg) {
+	struct dir_free_space *free_space = arg;
+	dir_free_space_set(free_space, free_space->nblocks, dir_block_gap(disk, dir_entry_from_index(disk, BLOCK_NUMBER(disk, block))));
+}
+
+
+static struct dir_free_space **dir_free_space_slot(unsigned int inode) {
+	struct dir_free_space **slot = &dir_free_space_table[inode % DIR_FREE_SPACE_BUCKETS];
+	while (*slot != NULL && (*slot)->inode != inode) {
+		slot = &(*slot)->next;
+	}
+	return slot;
+}
+
+
+static struct dir_free_space *dir_free_space_get(unsigned char *disk, unsigned int inode) {
+	struct dir_free_space **slot = dir_free_space_slot(inode);
+	if (*slot != NULL) {
+		return *slot;
+	}
+
+	struct dir_free_space *free_space = malloc(sizeof (struct dir_free_space));
+	if (free_space == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	free_space->next = NULL;
+	free_space->inode = inode;
+	free_space->nblocks = 0;
+	free_space->size = 0;
+	free_space->gaps = NULL;
+	free_space->prealloc.start = -1;
+	free_space->prealloc.len = 0;
+	inode_block_foreach(disk, inode, &dir_free_space_build_helper, free_space);
+
+	*slot = free_space;
+	return free_space;
+}
+
+
+/**
+ * Returns the nth block of the directory with a gap of at least size, or -1 if there is none.
+ */
+static unsigned int dir_free_space_find(struct dir_free_space *free_space, unsigned short size) {
+	if (free_space->size == 0 || free_space->gaps[1] < size) {
+		return -1;
+	}
+
+	unsigned int i = 1;
+	while (i < free_space->size) {
+		i = free_space->gaps[2 * i] >= size ? 2 * i : 2 * i + 1;
+	}
+	return i - free_space->size;
+}
+
+
+void dir_free_space_forget(unsigned int inode) {
+	struct dir_free_space **slot = dir_free_space_slot(inode);
+	if (*slot != NULL) {
+		struct dir_free_space *free_space = *slot;
+		*slot = free_space->next;
+		unreserve_block_run(&free_space->prealloc);
+		free(free_space->gaps);
+		free(free_space);
+	}
+}
+
+
+void dir_prealloc_forget(unsigned int inode) {
+	struct dir_free_space *free_space = *dir_free_space_slot(inode);
+	if (free_space != NULL) {
+		unreserve_block_run(&free_space->prealloc);
+	}
+}
+
+
+/**
+ * Returns how many blocks a directory reserves past its end when it grows. The super block only
+ * sets it when the flag is on, since it is meant for blocks kept by the directory on the disk. The
+ * windows here are only reserved in memory, so without the flag a default is used.
+ */
+static unsigned int dir_prealloc_blocks(unsigned char *disk) {
+	struct ext2_super_block *super_block = DISK_SUPER_BLOCK(disk);
+	if ((super_block->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_PREALLOC) && super_block->s_prealloc_dir_blocks) {
+		return super_block->s_prealloc_dir_blocks;
+	}
+	return DIR_PREALLOC_BLOCKS;
+}
+
+
+/**
+ * Reserves a new preallocation window for the directory, made of the free blocks from goal, right
+ * after its last block. Blocks anywhere else would not keep it together, so none are taken then.
+ */
+static void dir_prealloc_reserve(unsigned char *disk, struct dir_free_space *free_space, unsigned int goal) {
+	struct block_run *window = &free_space->prealloc;
+	if ((window->len = free_run_at(disk, goal, dir_prealloc_blocks(disk))) > 0) {
+		window->start = goal;
+		reserve_block_run(window);
+	}
+}
+
+
+/**
+ * Returns the block number of the nth datablock of the inode, or 0 if it is a hole. Unlike
+ * inode_block_slot, it never allocates the indirect blocks on the way.
+ */
+static unsigned int inode_block(unsigned char *disk, struct ext2_inode *inode_entry, unsigned int n) {
+	unsigned int p = DISK_BLOCK_SIZE(disk) / sizeof (unsigned int);
+	unsigned int block;
+	unsigned int level;
+
+	if (n < 12) {
+		return inode_entry->i_block[n];
+	}
+	n -= 12;
+	if (n < p) {
+		block = inode_entry->i_block[12];
+		level = 1;
+	} else if ((n -= p) < p * p) {
+		block = inode_entry->i_block[13];
+		level = 2;
 	} else {
-		errno = ENOSPC;
-		return NULL;
+		n -= p * p;
+		block = inode_entry->i_block[14];
+		level = 3;
+	}
+
+	for (unsigned int span = level == 3 ? p * p : level == 2 ? p : 1; level > 0 && block; level--, span /= p) {
+		block = ((unsigned int *) DISK_BLOCK(disk, block))[(n / span) % p];
 	}
+
+	return block;
 }
 
 
-struct ext2_dir_entry *rm_dir_entry(unsigned char *disk, unsigned int parent_inode, char *filename) {
+/**
+ * Fills in a new directory entry for the item, which has rec_len bytes to itself.
+ */
+static void dir_entry_fill(unsigned char *disk, unsigned int parent_inode, struct ext2_dir_entry *dir_entry, struct new_dir_entry_item *item, unsigned short rec_len) {
+	size_t name_len = strlen(item->name);
+
+	memcpy(dir_entry->name, item->name, name_len);
+	dir_entry->name_len = name_len;
+	dir_entry->inode = item->inode + 1;
+	dir_entry->file_type = item->file_type;
+	dir_entry->rec_len = rec_len;
+
+	inode_from_index(disk, item->inode)->i_links_count++;
+	dentry_cache_insert(parent_inode, item->name, item->inode);
+	item->dir_entry = dir_entry;
+}
+
+
+/**
+ * Puts the item in the first entry of the block with enough room, reusing it if it is unused.
+ * Returns false, without writing anything, if no entry in the block has room.
+ */
+static bool dir_block_insert(unsigned char *disk, unsigned int parent_inode, struct ext2_dir_entry *dir_entry, struct new_dir_entry_item *item, unsigned short size) {
+	unsigned int block_size = DISK_BLOCK_SIZE(disk);
+
+	for (unsigned int total = 0; total < block_size && dir_entry->rec_len; total += dir_entry->rec_len, dir_entry = (void *) dir_entry + dir_entry->rec_len) {
+		unsigned int dir_entry_size = dir_entry_used_size(dir_entry);
+		if (dir_entry->rec_len >= dir_entry_size + size) {
+			unsigned short rec_len = dir_entry->rec_len - dir_entry_size;
+			if (dir_entry_size) {
+				dir_entry->rec_len = dir_entry_size;
+				dir_entry = (void *) dir_entry + dir_entry_size;
+			}
+			dir_entry_fill(disk, parent_inode, dir_entry, item, rec_len);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+int new_dir_entries(unsigned char *disk, unsigned int parent_inode, struct new_dir_entry_item *items, unsigned int count) {
 	struct ext2_inode *parent_inode_entry = inode_from_index(disk, parent_inode);
-	struct ext2_dir_entry *dir = NULL;
-	struct ext2_dir_entry *before_file = NULL;
-	
-	for (int i = 0; before_file == NULL && i < 12 && parent_inode_entry->i_block[i]; i++) {
-		// TODO: handle indirection at i = 11
-		dir = dir_entry_from_index(disk, parent_inode_entry->i_block[i]);
-		before_file = dir_entry_before_name(dir, filename);
+	unsigned int block_size = DISK_BLOCK_SIZE(disk);
+	struct dir_free_space *free_space = dir_free_space_get(disk, parent_inode);
+	unsigned int pending = 0;
+
+	for (unsigned int i = 0; i < count; i++) {
+		items[i].dir_entry = NULL;
+	}
+
+	// Items go in the gaps left in the blocks the directory already has first.
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned short size = rec_len_boundary(sizeof(struct ext2_dir_entry) + strlen(items[i].name));
+		unsigned int n = dir_free_space_find(free_space, size);
+		if (n == -1) {
+			pending++;
+			continue;
+		}
+
+		// If the index was wrong about the block, the block is left out of it and the item goes in a
+		// new block instead of past the end of this one.
+		struct ext2_dir_entry *block_entry = dir_entry_from_index(disk, inode_block(disk, parent_inode_entry, n));
+		bool inserted = dir_block_insert(disk, parent_inode, block_entry, &items[i], size);
+		dir_free_space_set(free_space, n, inserted ? dir_block_gap(disk, block_entry) : 0);
+		if (!inserted) {
+			pending++;
+		}
+	}
+
+	if (pending == 0) {
+		return 0;
+	}
+
+	// The rest are packed one after the other into new blocks, allocated as a single run right
+	// after the last block of the directory when possible. A directory that grows past its first
+	// block reserves the blocks after its new last one as its preallocation window, and gives them
+	// back to the run the next time it grows, so that its blocks stay together while other files
+	// are allocated.
+	unsigned int nblocks = 1;
+	unsigned int used = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		if (items[i].dir_entry == NULL) {
+			unsigned short size = rec_len_boundary(sizeof(struct ext2_dir_entry) + strlen(items[i].name));
+			if (used + size > block_size) {
+				nblocks++;
+				used = 0;
+			}
+			used += size;
+		}
+	}
+
+	unsigned int first = parent_inode_entry->i_size / block_size;
+	unsigned int last_block = first > 0 ? inode_block(disk, parent_inode_entry, first - 1) : 0;
+	unsigned int goal = last_block ? BLOCK_INDEX(disk, last_block) + 1 : -1;
+	unsigned int remaining = nblocks + indirect_blocks_count(disk, first + nblocks) - indirect_blocks_count(disk, first);
+	struct block_run run = { goal, 0 };
+	unreserve_block_run(&free_space->prealloc);
+
+	// All the new blocks are allocated before any item is written to them, so that running out of
+	// space leaves the directory as it was, apart from the items that went in the gaps above.
+	unsigned int *blocks = malloc(nblocks * sizeof (unsigned int));
+	if (blocks == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned int i = 0; i < nblocks; i++) {
+		unsigned int *slot = inode_block_slot(disk, parent_inode_entry, first + i, &run, &remaining);
+		unsigned int block;
+		if (slot == NULL || (block = new_block_from_run(disk, &run, remaining--)) == -1) {
+			// inode_rm_block takes each datablock out of i_blocks, which is only added to below.
+			parent_inode_entry->i_blocks += i * (block_size / 512);
+			for (unsigned int j = i + 1; j-- > 0;) {
+				inode_rm_block(disk, parent_inode_entry, first + j, -1, &run, &remaining);
+			}
+			rm_block_run(disk, &run);
+			free(blocks);
+			errno = ENOSPC;
+			return -1;
+		}
+		*slot = blocks[i] = BLOCK_NUMBER(disk, block);
+	}
+	parent_inode_entry->i_size += nblocks * block_size;
+	parent_inode_entry->i_blocks += nblocks * (block_size / 512);
+
+	struct ext2_dir_entry *block_entry = NULL;
+	struct ext2_dir_entry *last = NULL;
+	unsigned int n = first - 1;
+	used = block_size;
+
+	for (unsigned int i = 0; i < count; i++) {
+		if (items[i].dir_entry != NULL) {
+			continue;
+		}
+
+		unsigned short size = rec_len_boundary(sizeof(struct ext2_dir_entry) + strlen(items[i].name));
+		if (used + size > block_size) {
+			// The last entry of a full block gets whatever is left of it.
+			if (last != NULL) {
+				last->rec_len += block_size - used;
+				dir_free_space_set(free_space, n, dir_block_gap(disk, block_entry));
+			}
+
+			n++;
+			block_entry = dir_entry_from_index(disk, blocks[n - first]);
+			memset(block_entry, 0, block_size);
+			used = 0;
+		}
+
+		last = (void *) block_entry + used;
+		dir_entry_fill(disk, parent_inode, last, &items[i], size);
+		used += size;
 	}
+	last->rec_len += block_size - used;
+	dir_free_space_set(free_space, n, dir_block_gap(disk, block_entry));
+	free(blocks);
 
-	if (before_file) {
-		struct ext2_dir_entry *file = (struct ext2_dir_entry *)((void *) before_file + before_file->rec_len);
+	rm_block_run(disk, &run);
+	if (first > 0) {
+		dir_prealloc_reserve(disk, free_space, run.start);
+	}
+
+	return 0;
+}
+
+
+struct ext2_dir_entry *new_dir_entry(unsigned char *disk, unsigned int parent_inode, unsigned int child_inode, char *name, unsigned char file_type) {
+	struct new_dir_entry_item item = { name, child_inode, file_type, NULL };
+	if (new_dir_entries(disk, parent_inode, &item, 1) == -1) {
+		return NULL;
+	}
+	return item.dir_entry;
+}
+
+
+struct rm_dir_entry_data {
+	char *filename;
+	size_t filename_len;
+	unsigned int n;
+	struct ext2_dir_entry *block_entry;
+	struct ext2_dir_entry *before_file;
+};
+
+
+static struct ext2_dir_entry *rm_dir_entry_find(unsigned char *disk, unsigned int inode, unsigned int block, void *arg) {
+	struct rm_dir_entry_data *data = arg;
+	struct ext2_dir_entry *dir_entry = dir_entry_from_index(disk, block);
+	struct ext2_dir_entry *prev_dir_entry = dir_entry;
+	unsigned int block_size = DISK_BLOCK_SIZE(disk);
+
+	data->block_entry = dir_entry;
+	for (unsigned int total = 0; total < block_size && dir_entry->rec_len; total += dir_entry->rec_len, dir_entry = (void *) dir_entry + dir_entry->rec_len) {
+		if (dir_entry->inode && data->filename_len == dir_entry->name_len && strncmp(data->filename, dir_entry->name, dir_entry->name_len) == 0) {
+			data->before_file = prev_dir_entry;
+			return dir_entry;
+		}
+		prev_dir_entry = dir_entry;
+	}
+
+	data->n++;
+	return NULL;
+}
+
+
+struct ext2_dir_entry *rm_dir_entry(unsigned char *disk, unsigned int parent_inode, char *filename) {
+	struct rm_dir_entry_data data;
+	data.filename = filename;
+	data.filename_len = strlen(filename);
+	data.n = 0;
+	data.before_file = NULL;
+
+	struct ext2_dir_entry *file = inode_dir_entry_find(disk, parent_inode, &rm_dir_entry_find, &data);
+	struct ext2_dir_entry *before_file = data.before_file;
+
+	if (file) {
 		unsigned int file_inode = file->inode - 1;
 		struct ext2_inode *file_inode_entry = inode_from_index(disk, file_inode);
 
-		bool isFirstEntry = file->name_len == before_file->name_len && strncmp(file->name, before_file->name, before_file->name_len) == 0;
-		if (isFirstEntry) {
+		if (file == before_file) {
 			dir_entry_to_blank(file);
 		} else {
 			dir_entry_rm_next(before_file);
 		}
 
+		dentry_cache_insert(parent_inode, filename, -1);
+		struct dir_free_space *free_space = *dir_free_space_slot(parent_inode);
+		if (free_space != NULL) {
+			dir_free_space_set(free_space, data.n, dir_block_gap(disk, data.block_entry));
+		}
+
 		file_inode_entry->i_links_count--;
 		if (file_inode_entry->i_links_count == 0) {
-			inode_block_foreach(disk, file_inode, &rm_dir_entry_helper, NULL);
+			rm_inode_blocks(disk, file_inode);
 			rm_inode(disk, file_inode);
 		}
 	} else {
@@ -599,26 +1833,9 @@ void rm_dir_entry_helper(unsigned char *disk, unsigned int inode, unsigned int b
 }
 
 
-char *read_to_memory(char *path) {
-	char *buffer = NULL;
-	FILE *fp = fopen(path, "r");
-	long size = 0L;
-
-	if (fp == NULL) {
-		return NULL;
-	}
-
-	fseek(fp, 0L, SEEK_END);
-	size = ftell(fp);
-	rewind(fp);
-
-	buffer = calloc(1, size + 1);
-	if (buffer == NULL || (size > 0 && 1 != fread(buffer, size, 1, fp))) {
-		return NULL;
-	}
-
-	fclose(fp);
-	return buffer;
+void rm_inode_blocks(unsigned char *disk, unsigned int inode) {
+	inode_block_foreach(disk, inode, &rm_dir_entry_helper, NULL);
+	inode_indirect_block_foreach(disk, inode, &rm_dir_entry_helper, NULL);
 }
 
 
@@ -633,52 +1850,291 @@ char *path_join(char *path1, char *path2) {
 }
 
 
+unsigned int indirect_blocks_count(unsigned char *disk, unsigned int nblocks) {
+	unsigned int p = DISK_BLOCK_SIZE(disk) / sizeof (unsigned int);
+	unsigned int count = 0;
+
+	if (nblocks <= 12) {
+		return 0;
+	}
+	nblocks -= 12;
+	count += 1;
+	if (nblocks <= p) {
+		return count;
+	}
+	nblocks -= p;
+	if (nblocks <= p * p) {
+		return count + 1 + (nblocks + p - 1) / p;
+	}
+	count += 1 + p;
+	nblocks -= p * p;
+	return count + 1 + (nblocks + p * p - 1) / (p * p) + (nblocks + p - 1) / p;
+}
+
+
 struct ext2_dir_entry *write_string_to_blocks(unsigned char *disk, struct ext2_dir_entry *dir_entry, char *source) {
 	size_t source_len = strlen(source);
 	struct ext2_inode *inode_entry = inode_from_index(disk, dir_entry->inode - 1);
-	inode_entry->i_size = source_len;
-	int i, size;
+	unsigned int block_size = DISK_BLOCK_SIZE(disk);
 
-	for (i = 0, size = 0; size < inode_entry->i_size && i < 12; i++, size += EXT2_BLOCK_SIZE) {
-		// TODO: if (inode_entry->i_block[i] != 0), then delete block
-		unsigned int block = new_block(disk);
-		if (block == -1) {
+	// Data blocks plus the indirect blocks, allocated in file order so the file is contiguous.
+	unsigned int nblocks = (source_len + block_size - 1) / block_size;
+	unsigned int remaining = nblocks + indirect_blocks_count(disk, nblocks);
+	struct block_run run = { -1, 0 };
+
+	inode_entry->i_size = source_len;
+	for (unsigned int i = 0; i < nblocks; i++) {
+		unsigned char *destination = inode_new_block(disk, inode_entry, i, &run, &remaining);
+		if (destination == NULL) {
 			return NULL;
 		}
-		inode_entry->i_block[i] = block + 1;
-		inode_entry->i_blocks += EXT2_BLOCK_SIZE / 512;
+		memcpy(destination, source, MIN(source_len - (size_t) i * block_size, block_size));
+		source += block_size;
+	}
+
+	return dir_entry;
+}
+
 
-		void *destination = (void *)(disk + EXT2_BLOCK_SIZE * (block + 1));
-		unsigned int bytes = MIN(inode_entry->i_size - size, EXT2_BLOCK_SIZE);
-		memcpy(destination, source, bytes);
-		source += EXT2_BLOCK_SIZE;
+bool pread_to_disk(int fd, unsigned char *destination, size_t len, off_t offset) {
+	while (len > 0) {
+		ssize_t nread = pread(fd, destination, len, offset);
+		if (nread <= 0) {
+			if (nread == 0) {
+				errno = EIO;
+			}
+			return false;
+		}
+		destination += nread;
+		len -= nread;
+		offset += nread;
 	}
+	return true;
+}
 
-	unsigned int *indirect_i_block = NULL;
-	if (size < inode_entry->i_size) {
-		unsigned int block = new_block(disk);
-		if (block == -1) {
-			return NULL;
+
+int inode_alloc_blocks(unsigned char *disk, unsigned int inode, size_t size, bool (*callback)(unsigned char *, size_t, off_t, void *), void *arg) {
+	struct ext2_inode *inode_entry = inode_from_index(disk, inode);
+	unsigned int block_size = DISK_BLOCK_SIZE(disk);
+
+	if (size > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	unsigned int nblocks = (size + block_size - 1) / block_size;
+	unsigned int remaining = nblocks + indirect_blocks_count(disk, nblocks);
+	struct block_run run = { -1, 0 };
+
+	// Datablocks that are next to each other in the disk are handed to the callback as one run.
+	unsigned char *pending = NULL;
+	size_t pending_len = 0;
+	off_t pending_offset = 0;
+
+	inode_entry->i_size = size;
+	for (unsigned int n = 0; n < nblocks; n++) {
+		unsigned char *destination = inode_new_block(disk, inode_entry, n, &run, &remaining);
+		if (destination == NULL) {
+			rm_block_run(disk, &run);
+			return -1;
 		}
-		inode_entry->i_block[i] = block + 1;
-		inode_entry->i_blocks += EXT2_BLOCK_SIZE / 512;
-		indirect_i_block = (unsigned int *)(disk + EXT2_BLOCK_SIZE * (block + 1));
+
+		if (destination != pending + pending_len) {
+			if (pending_len > 0 && !(*callback)(pending, pending_len, pending_offset, arg)) {
+				rm_block_run(disk, &run);
+				return -1;
+			}
+			pending = destination;
+			pending_offset += pending_len;
+			pending_len = 0;
+		}
+		pending_len += MIN(size - (size_t) n * block_size, block_size);
 	}
 
-	for (i = 0; size < inode_entry->i_size && i < 256; i++, size += EXT2_BLOCK_SIZE) {
-		unsigned int block = new_block(disk);
-		if (block == -1) {
+	if (pending_len > 0 && !(*callback)(pending, pending_len, pending_offset, arg)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+bool write_from_disk(int fd, unsigned char *source, size_t len) {
+	while (len > 0) {
+		ssize_t nwritten = write(fd, source, len);
+		if (nwritten == -1) {
+			return false;
+		}
+		source += nwritten;
+		len -= nwritten;
+	}
+	return true;
+}
+
+
+struct write_blocks_to_file_data {
+	int fd;
+	bool seekable;
+	unsigned char *pending;
+	size_t pending_len;
+	size_t offset;  /* Where the contents written so far end, including pending and the holes */
+	size_t size;
+	bool failed;
+};
+
+
+/**
+ * Writes a hole of len bytes to fd. When fd is a regular file the hole is seeked over so that the
+ * file is sparse on the host too, otherwise zeros are written.
+ */
+static bool write_hole_to_file(int fd, bool seekable, size_t len) {
+	static unsigned char zeros[1 << 16];
+
+	if (seekable) {
+		return lseek(fd, len, SEEK_CUR) != -1;
+	}
+	while (len > 0) {
+		size_t zeros_len = MIN(len, sizeof zeros);
+		if (!write_from_disk(fd, zeros, zeros_len)) {
+			return false;
+		}
+		len -= zeros_len;
+	}
+	return true;
+}
+
+
+static void write_blocks_to_file_helper(unsigned char *disk, unsigned int inode, unsigned int n, unsigned int block, void *arg) {
+	struct write_blocks_to_file_data *data = arg;
+	unsigned char *source = DISK_BLOCK(disk, BLOCK_NUMBER(disk, block));
+	size_t position = (size_t) n * DISK_BLOCK_SIZE(disk);
+	size_t len = MIN(data->size - position, DISK_BLOCK_SIZE(disk));
+
+	if (data->failed) {
+		return;
+	}
+
+	if (position != data->offset || source != data->pending + data->pending_len) {
+		if (!write_from_disk(data->fd, data->pending, data->pending_len) || !write_hole_to_file(data->fd, data->seekable, position - data->offset)) {
+			data->failed = true;
+			return;
+		}
+		data->pending = source;
+		data->pending_len = 0;
+	}
+	data->pending_len += len;
+	data->offset = position + len;
+}
+
+
+int write_blocks_to_file(unsigned char *disk, unsigned int inode, int fd) {
+	struct stat stat;
+	if (fstat(fd, &stat) == -1) {
+		return -1;
+	}
+
+	struct write_blocks_to_file_data data;
+	data.fd = fd;
+	data.seekable = S_ISREG(stat.st_mode);
+	data.pending = NULL;
+	data.pending_len = 0;
+	data.offset = 0;
+	data.size = inode_from_index(disk, inode)->i_size;
+	data.failed = false;
+
+	// Datablocks that are next to each other in the disk are written out with a single write.
+	inode_file_block_foreach(disk, inode, &write_blocks_to_file_helper, &data);
+	if (data.failed || !write_from_disk(fd, data.pending, data.pending_len)) {
+		return -1;
+	}
+
+	// A hole at the end has nothing after it to extend the file, so it is truncated up to its size.
+	if (data.offset < data.size) {
+		if (!write_hole_to_file(fd, data.seekable, data.size - data.offset)) {
+			return -1;
+		}
+		off_t end;
+		if (data.seekable && ((end = lseek(fd, 0, SEEK_CUR)) == -1 || ftruncate(fd, end) == -1)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * How many blocks of a host file write_file_to_blocks reads before it looks for the zero ones.
+ */
+#define WRITE_FILE_READ_BLOCKS 64
+
+
+bool is_zero(unsigned char *buffer, size_t len) {
+	// Comparing the buffer against itself one byte along leaves the scan to memcmp, which the C
+	// library vectorizes.
+	return len == 0 || (buffer[0] == 0 && memcmp(buffer, buffer + 1, len - 1) == 0);
+}
+
+
+struct ext2_dir_entry *write_file_to_blocks(unsigned char *disk, struct ext2_dir_entry *dir_entry, int fd, size_t size) {
+	struct ext2_inode *inode_entry = inode_from_index(disk, dir_entry->inode - 1);
+	unsigned int block_size = DISK_BLOCK_SIZE(disk);
+
+	if (size > UINT32_MAX) {
+		errno = EFBIG;
+		return NULL;
+	}
+
+	unsigned int nblocks = (size + block_size - 1) / block_size;
+	unsigned int remaining = nblocks + indirect_blocks_count(disk, nblocks);
+	struct block_run run = { -1, 0 };
+
+	// The file is read a few blocks at a time straight into the blocks allocated for it, one pread
+	// for each run of them that are next to each other in the disk. The blocks that turn out to be
+	// all zeros are then taken out again, last first so that they go back to the front of the run
+	// and the next blocks are read into them. An indirect block they leave empty is kept while the
+	// blocks after the chunk may still need it.
+	inode_entry->i_size = size;
+	for (unsigned int n = 0; n < nblocks; n += WRITE_FILE_READ_BLOCKS) {
+		unsigned int count = MIN(nblocks - n, WRITE_FILE_READ_BLOCKS);
+		unsigned char *pending = NULL;
+		size_t pending_len = 0;
+		off_t pending_offset = (off_t) n * block_size;
+
+		for (unsigned int i = 0; i < count; i++) {
+			size_t offset = (size_t) (n + i) * block_size;
+			unsigned char *destination = inode_new_block(disk, inode_entry, n + i, &run, &remaining);
+			if (destination == NULL) {
+				rm_block_run(disk, &run);
+				return NULL;
+			}
+
+			if (destination != pending + pending_len) {
+				if (!pread_to_disk(fd, pending, pending_len, pending_offset)) {
+					rm_block_run(disk, &run);
+					return NULL;
+				}
+				pending = destination;
+				pending_offset = offset;
+				pending_len = 0;
+			}
+			pending_len += MIN(size - offset, block_size);
+		}
+		if (!pread_to_disk(fd, pending, pending_len, pending_offset)) {
+			rm_block_run(disk, &run);
 			return NULL;
 		}
-		indirect_i_block[i] = block + 1;
-		inode_entry->i_blocks += EXT2_BLOCK_SIZE / 512;
 
-		void *destination = (void *)(disk + EXT2_BLOCK_SIZE * (block + 1));
-		unsigned int bytes = MIN(inode_entry->i_size - size, EXT2_BLOCK_SIZE);
-		memcpy(destination, source, bytes);
-		source += EXT2_BLOCK_SIZE;
+		unsigned int limit = n + count < nblocks ? n + count : -1;
+		for (unsigned int i = count; i-- > 0;) {
+			size_t offset = (size_t) (n + i) * block_size;
+			if (is_zero(DISK_BLOCK(disk, inode_block(disk, inode_entry, n + i)), MIN(size - offset, block_size))) {
+				inode_rm_block(disk, inode_entry, n + i, limit, &run, &remaining);
+			}
+		}
 	}
 
+	rm_block_run(disk, &run);
 	return dir_entry;
 }
 
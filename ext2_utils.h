@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
@@ -17,24 +18,71 @@
 #include "ext2.h"
 
 
-#define DISK_SUPER_BLOCK(disk) ((struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE * 1))
+#define DISK_SUPER_BLOCK(disk) ((struct ext2_super_block *)(disk + EXT2_SUPER_BLOCK_OFFSET))
 
-#define DISK_GROUP_DESC(disk) ((struct ext2_group_desc *)(disk + EXT2_BLOCK_SIZE * 2))
+#define DISK_BLOCK_SIZE(disk) (EXT2_MIN_BLOCK_SIZE << DISK_SUPER_BLOCK(disk)->s_log_block_size)
 
-#define DISK_BLOCK_BITMAP(disk) ((unsigned char *)(disk + EXT2_BLOCK_SIZE * DISK_GROUP_DESC(disk)->bg_block_bitmap))
+#define DISK_BLOCK(disk, block) ((unsigned char *)(disk + (size_t) DISK_BLOCK_SIZE(disk) * (block)))
 
-#define DISK_INODE_BITMAP(disk) ((unsigned char *)(disk + EXT2_BLOCK_SIZE * DISK_GROUP_DESC(disk)->bg_inode_bitmap))
+#define DISK_GROUP_COUNT(disk) ((DISK_SUPER_BLOCK(disk)->s_blocks_count - DISK_SUPER_BLOCK(disk)->s_first_data_block + DISK_SUPER_BLOCK(disk)->s_blocks_per_group - 1) / DISK_SUPER_BLOCK(disk)->s_blocks_per_group)
 
-#define DISK_INODE_TABLE(disk) ((struct ext2_inode *)(disk + EXT2_BLOCK_SIZE * DISK_GROUP_DESC(disk)->bg_inode_table))
+#define DISK_INODE_SIZE(disk) (DISK_SUPER_BLOCK(disk)->s_rev_level == EXT2_GOOD_OLD_REV ? EXT2_GOOD_OLD_INODE_SIZE : DISK_SUPER_BLOCK(disk)->s_inode_size)
+
+#define DISK_GROUP_DESC(disk, group) ((struct ext2_group_desc *) DISK_BLOCK(disk, DISK_SUPER_BLOCK(disk)->s_first_data_block + 1) + (group))
+
+#define DISK_BLOCK_BITMAP(disk, group) DISK_BLOCK(disk, DISK_GROUP_DESC(disk, group)->bg_block_bitmap)
+
+#define DISK_INODE_BITMAP(disk, group) DISK_BLOCK(disk, DISK_GROUP_DESC(disk, group)->bg_inode_bitmap)
+
+#define DISK_INODE_TABLE(disk, group) DISK_BLOCK(disk, DISK_GROUP_DESC(disk, group)->bg_inode_table)
+
+/**
+ * Converts between block numbers, as stored in i_block, and block indices, as used by the block
+ * bitmaps and the block functions below, which start at 0 for the first data block.
+ */
+#define BLOCK_NUMBER(disk, block) ((block) + DISK_SUPER_BLOCK(disk)->s_first_data_block)
+
+#define BLOCK_INDEX(disk, block) ((block) - DISK_SUPER_BLOCK(disk)->s_first_data_block)
+
+/**
+ * The block group an inode or block index belongs to, and its bit in that group's bitmap.
+ */
+#define INODE_GROUP(disk, inode) ((inode) / DISK_SUPER_BLOCK(disk)->s_inodes_per_group)
+
+#define INODE_GROUP_INDEX(disk, inode) ((inode) % DISK_SUPER_BLOCK(disk)->s_inodes_per_group)
+
+#define BLOCK_GROUP(disk, block) ((block) / DISK_SUPER_BLOCK(disk)->s_blocks_per_group)
+
+#define BLOCK_GROUP_INDEX(disk, block) ((block) % DISK_SUPER_BLOCK(disk)->s_blocks_per_group)
 
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
+/**
+ * Options for `load_disk`, combined with bitwise or.
+ * 
+ * LOAD_DISK_READ_ONLY maps the image PROT_READ and MAP_PRIVATE, for tools that never write.
+ * LOAD_DISK_POPULATE prefaults the whole mapping, worthwhile when most of the image is read.
+ * LOAD_DISK_SEQUENTIAL and LOAD_DISK_RANDOM are passed on to madvise as access pattern hints.
+ */
+#define LOAD_DISK_READ_ONLY  0x1
+#define LOAD_DISK_POPULATE   0x2
+#define LOAD_DISK_SEQUENTIAL 0x4
+#define LOAD_DISK_RANDOM     0x8
+
 /**
  * Memory maps the disk image and returns a pointer to the beginning of the disk.
+ * 
+ * The mapping covers the whole file system as described by the superblock, exits if the image
+ * is not an ext2 file system or is smaller than the file system it describes.
+ */
+unsigned char *load_disk(char *path, int flags);
+
+/**
+ * Flushes every change made through the mapping back to the disk image, returns -1 on error.
  */
-unsigned char *load_disk(char *path);
+int sync_disk(unsigned char *disk);
 
 
 /**
@@ -61,22 +109,32 @@ bool is_inode_reserved(unsigned int inode);
 
 /**
  * For each datablock in the inode, the callback is called with disk pointer, inode number, block
- * number, and arg.
+ * number, and arg. Holes in sparse files are skipped.
  */
 void inode_block_foreach(unsigned char *disk, unsigned int inode, void (*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg);
-bool inode_block_foreach_helper(unsigned char *disk, unsigned int inode, unsigned int *i_block, unsigned int blocks, unsigned int indirection, void (*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg);
 
 /**
- * For each datablock in the inode, the callback is called with the disk pointer, inode number, and
- * arg.
+ * Same as inode_block_foreach, but the callback is also called with the position of the datablock
+ * in the contents of the inode, after the inode number, so that the holes can be told apart.
+ */
+void inode_file_block_foreach(unsigned char *disk, unsigned int inode, void (*callback)(unsigned char *, unsigned int, unsigned int, unsigned int, void *), void *arg);
+
+/**
+ * For each single, double, and triple indirect block in the inode, the callback is called with
+ * the disk pointer, inode number, block number, and arg, in the order they are reached. Holes
+ * are skipped at every level.
+ */
+void inode_indirect_block_foreach(unsigned char *disk, unsigned int inode, void (*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg);
+
+/**
+ * For each datablock in the inode, through the direct, single, double, and triple indirect
+ * blocks, the callback is called with the disk pointer, inode number, block number, and arg.
  * 
- * If callback returns true, then the find returns the datablock which made the callback return
- * true.
+ * If callback returns a directory entry, then the find stops and returns it.
  * 
- * Returns -1 if the find fails.
+ * Returns NULL if the find fails, or if the entry found is unused.
  */
 struct ext2_dir_entry *inode_dir_entry_find(unsigned char *disk, unsigned int inode, struct ext2_dir_entry *(*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg);
-struct ext2_dir_entry *inode_dir_entry_find_helper(unsigned char *disk, unsigned int inode, unsigned int *iblocks_tbl, unsigned int nblocks, unsigned int indirection, struct ext2_dir_entry *(*callback)(unsigned char *, unsigned int, unsigned int, void *), void *arg);
 
 /**
  * For each inode on the disk, the callback is called with the disk pointer, inode number and arg.
@@ -85,10 +143,17 @@ struct ext2_dir_entry *inode_dir_entry_find_helper(unsigned char *disk, unsigned
  */
 void inode_foreach(unsigned char *disk, void (*callback)(unsigned char *, unsigned int, void *), void *arg);
 
+/**
+ * Same as inode_foreach, but only for the count inodes starting at the first inode.
+ */
+void inode_range_foreach(unsigned char *disk, unsigned int first, unsigned int count, void (*callback)(unsigned char *, unsigned int, void *), void *arg);
+
 
 /**
  * For each block on the disk, the callback is called with the disk pointer, block number, and arg.
  * 
+ * Block numbers are bitmap indices, they start at 0 for the first data block.
+ * 
  * Use `is_block_free(block)` to to check whether or not the inode is in use.
  */
 void block_foreach(unsigned char *disk, void (*callback)(unsigned char *, unsigned int, void *), void *arg);
@@ -137,17 +202,61 @@ bool is_block_free(unsigned char *disk, unsigned int block);
 
 /**
  * Returns the index of the next free inode.
+ * 
+ * Scans the inode bitmaps a word at a time, resuming from the lowest inode that was freed or not
+ * yet looked at by this process.
+ * 
+ * Returns -1 if every inode is in use.
  */
 unsigned int next_free_inode(unsigned char *disk);
 
-bool next_free_inode_helper(unsigned char *disk, unsigned int inode, void *arg);
-
 /**
  * Returns the index of the next free datablock.
+ * 
+ * Scans the block bitmaps a word at a time, resuming from the lowest block that was freed or not
+ * yet looked at by this process.
+ * 
+ * Returns -1 if every block is in use.
  */
 unsigned int next_free_block(unsigned char *disk);
 
-bool next_free_block_helper(unsigned char *disk, unsigned int block, void *arg);
+/**
+ * A run of contiguous blocks that have been allocated but not yet handed out.
+ */
+struct block_run {
+	unsigned int start;  /* Index of the next block in the run */
+	unsigned int len;    /* Blocks left in the run */
+};
+
+/**
+ * Allocates a run of up to count contiguous free blocks and stores its length in run_len.
+ * 
+ * The run starts at goal if that block is free. Otherwise it is the first run of count free
+ * blocks, or the longest free run when there is none that long. Pass -1 as the goal for no
+ * preference. The bitmap and free block counters are updated once for the whole run.
+ * 
+ * Returns the index of the first block, or -1 on failure and errno is set.
+ */
+unsigned int new_block_run(unsigned char *disk, unsigned int goal, unsigned int count, unsigned int *run_len);
+
+/**
+ * Hands out the next block of the run, allocating a new run when it is empty. The new run is
+ * sized for the remaining blocks the caller still needs, and tries to continue right after the
+ * previous one. Start with { -1, 0 } for no goal.
+ * 
+ * Returns -1 on failure and errno is set.
+ */
+unsigned int new_block_from_run(unsigned char *disk, struct block_run *run, unsigned int remaining);
+
+/**
+ * Frees the blocks left in the run that were never handed out, and empties it.
+ */
+void rm_block_run(unsigned char *disk, struct block_run *run);
+
+/**
+ * Returns the number of blocks in the group, the last group may be shorter than the others.
+ */
+unsigned int group_blocks_count(unsigned char *disk, unsigned int group);
 
 /**
  * Aligns the rec_len to the 4 byte boundary by increasing it.
@@ -184,6 +293,32 @@ char *get_filename(char *abspath);
 unsigned int inode_by_filepath(unsigned char *disk, char *abspath);
 struct ext2_dir_entry *inode_by_filepath_helper(unsigned char *disk, unsigned int inode, unsigned int block, void *arg);
 
+/**
+ * Looks up the inode named name in the parent directory in the dentry cache.
+ * 
+ * Returns false on a miss, otherwise sets inode, which is -1 if the name is known not to exist.
+ */
+bool dentry_cache_lookup(unsigned int parent, char *name, unsigned int *inode);
+
+/**
+ * Records that name in the parent directory refers to inode, or to nothing if inode is -1.
+ * 
+ * Anything that adds, removes, or revives a directory entry must keep the cache up to date.
+ */
+void dentry_cache_insert(unsigned int parent, char *name, unsigned int inode);
+
+/**
+ * Adds every entry in the directory to the dentry cache, and remembers that it is indexed so that
+ * a name missing from the cache is known not to be in the directory.
+ */
+void dentry_index_directory(unsigned char *disk, unsigned int inode);
+
+/**
+ * Returns the inode the name refers to in the directory, or -1 if there is no such entry. Goes
+ * through the dentry cache, and indexes large directories whole on their first miss.
+ */
+unsigned int dir_inode_by_name(unsigned char *disk, unsigned int inode, char *filename);
+
 /**
  * Modifies the absolute path pointer to point to the next / and returns the filename of the
  * file that was just shifted.
@@ -195,7 +330,7 @@ char *shift_filepath(char **abspath);
  * 
  * Returns NULL if no such directory is found.
  */
-struct ext2_dir_entry *dir_entry_by_name(struct ext2_dir_entry *dir_entry, char *filename);
+struct ext2_dir_entry *dir_entry_by_name(unsigned char *disk, struct ext2_dir_entry *dir_entry, char *filename);
 
 /**
  * Looks for a directory entry with a given name and returns the previous dir_entry.
@@ -207,7 +342,7 @@ struct ext2_dir_entry *dir_entry_by_name(struct ext2_dir_entry *dir_entry, char
  * IMPORTANT:
  * Check if the result is not NULL and if the dir_entry->name matches the filename.
  */
-struct ext2_dir_entry *dir_entry_before_name(struct ext2_dir_entry *dir_entry, char *filename);
+struct ext2_dir_entry *dir_entry_before_name(unsigned char *disk, struct ext2_dir_entry *dir_entry, char *filename);
 
 /**
  * Sets the nth bit in the bitmap to 1.
@@ -224,6 +359,32 @@ void unset_bit_by_index(unsigned char *bitmap, unsigned int n);
  */
 bool is_bit_set_by_index(unsigned char *bitmap, unsigned int n);
 
+/**
+ * Returns the number of set bits in a bitmap of nbits bits, 64 bits at a time with popcount.
+ */
+unsigned int bitmap_count_set(unsigned char *bitmap, unsigned int nbits);
+
+/**
+ * Returns the index of the first unset bit at or after start in a bitmap of nbits bits.
+ * 
+ * Scans 64 bits at a time, skipping full words.
+ * 
+ * Returns -1 if every bit from start on is set.
+ */
+unsigned int bitmap_find_zero(unsigned char *bitmap, unsigned int start, unsigned int nbits);
+
+/**
+ * Returns the index of the first set bit at or after start in a bitmap of nbits bits.
+ * 
+ * Returns -1 if no bit from start on is set.
+ */
+unsigned int bitmap_find_set(unsigned char *bitmap, unsigned int start, unsigned int nbits);
+
+/**
+ * Sets len bits of the bitmap starting at the start bit.
+ */
+void bitmap_set_range(unsigned char *bitmap, unsigned int start, unsigned int len);
+
 /**
  * Initializes a new inode in the next free spot.
  * 
@@ -248,6 +409,16 @@ void rm_inode(unsigned char *disk, unsigned int inode);
  */
 void rm_block(unsigned char *disk, unsigned int block);
 
+/**
+ * Marks an inode as used and decrements the free inode counters of the superblock and its group.
+ */
+void mark_inode_used(unsigned char *disk, unsigned int inode);
+
+/**
+ * Marks a block as used and decrements the free block counters of the superblock and its group.
+ */
+void mark_block_used(unsigned char *disk, unsigned int block);
+
 /**
  * Initializes a new inode as a directory in the next free spot.
  * 
@@ -269,9 +440,35 @@ unsigned int new_inode_file(unsigned char *disk);
  */
 unsigned int new_inode_link(unsigned char *disk);
 
+/**
+ * A directory entry to insert with new_dir_entries, dir_entry is set to the entry once it is in
+ * the directory.
+ */
+struct new_dir_entry_item {
+	char *name;
+	unsigned int inode;
+	unsigned char file_type;
+	struct ext2_dir_entry *dir_entry;
+};
+
+/**
+ * Inserts count new directory entries into a directory inode in one pass. The items that fit in
+ * the room left in the blocks the directory already has go there, and the rest are packed densely
+ * into new blocks allocated together right after it.
+ * 
+ * Returns -1 on failure and errno is set. The new blocks are all allocated before any item is
+ * written to them, so then only the items that went in the existing blocks are in the directory,
+ * and those are the ones with a dir_entry. The caller is left to free or link the others. Returns 0
+ * on success.
+ */
+int new_dir_entries(unsigned char *disk, unsigned int parent_inode, struct new_dir_entry_item *items, unsigned int count);
+
 /**
  * Inserts a new directory entry into a directory inode with a given name pointing to a given inode.
  * 
+ * The entry goes in the first block with room for it, reusing space freed by removed entries, and
+ * the directory only grows, through its indirect blocks if needed, when no block has room.
+ * 
  * Returns NULL on failure and errno is set.
  */
 struct ext2_dir_entry *new_dir_entry(unsigned char *disk, unsigned int parent_inode, unsigned int child_inode, char *name, unsigned char file_type);
@@ -285,9 +482,21 @@ struct ext2_dir_entry *rm_dir_entry(unsigned char *disk, unsigned int parent_ino
 void rm_dir_entry_helper(unsigned char *disk, unsigned int inode, unsigned int block, void *arg);
 
 /**
- * Reads a file into memory and returns a pointer to the beginning of the file in memory.
+ * Frees every datablock and indirect block of the inode.
  */
-char *read_to_memory(char *path);
+void rm_inode_blocks(unsigned char *disk, unsigned int inode);
+
+/**
+ * Drops the free space index of the directory, for when its entries are changed other than
+ * through new_dir_entry and rm_dir_entry. It is rebuilt on the next insert.
+ */
+void dir_free_space_forget(unsigned int inode);
+
+/**
+ * Gives back the blocks reserved past the end of the directory that it has not grown into, for
+ * when no more entries are going to be added to it.
+ */
+void dir_prealloc_forget(unsigned int inode);
 
 /**
  * Returns a new path with path1 and path2 joined with a '/'
@@ -295,12 +504,62 @@ char *read_to_memory(char *path);
 char *path_join(char *path1, char *path2);
 
 /**
- * Creates (strlen(source) / EXT2_BLOCK_SIZE) blocks and writes the source string into the blocks.
+ * Returns the number of indirect blocks needed to map nblocks datablocks.
+ */
+unsigned int indirect_blocks_count(unsigned char *disk, unsigned int nblocks);
+
+/**
+ * Creates (strlen(source) / block size) blocks and writes the source string into the blocks.
  * 
  * Returns NULL on failute and errno is set.
  */
 struct ext2_dir_entry *write_string_to_blocks(unsigned char *disk, struct ext2_dir_entry *dir_entry, char *source);
 
+/**
+ * Reads size bytes from fd into newly allocated blocks of the inode.
+ * 
+ * The file is read straight into the disk. Blocks that turn out to be all zeros are then left as
+ * holes and take no space in the disk. The file may contain any bytes.
+ * 
+ * Returns NULL on failure and errno is set.
+ */
+struct ext2_dir_entry *write_file_to_blocks(unsigned char *disk, struct ext2_dir_entry *dir_entry, int fd, size_t size);
+
+/**
+ * Allocates the datablocks, and the indirect blocks they need, for size bytes of contents of the
+ * inode and sets its size. For each run of the datablocks that are next to each other in the
+ * disk, the callback is called with a pointer to the run, its length in bytes, the offset in the
+ * contents it starts at, and arg, and returns false to stop.
+ * 
+ * Returns -1 on failure and errno is set, or 0 on success.
+ */
+int inode_alloc_blocks(unsigned char *disk, unsigned int inode, size_t size, bool (*callback)(unsigned char *, size_t, off_t, void *), void *arg);
+
+/**
+ * Reads len bytes at offset in fd straight into the disk at destination, returns false on failure
+ * and errno is set.
+ */
+bool pread_to_disk(int fd, unsigned char *destination, size_t len, off_t offset);
+
+/**
+ * Returns whether the len bytes at buffer are all zero.
+ */
+bool is_zero(unsigned char *buffer, size_t len);
+
+/**
+ * Writes the contents of the inode from the disk to fd, one write for each run of datablocks that
+ * are next to each other in the disk, straight out of the mapping. Holes are seeked over when fd is
+ * a regular file, and written as zeros otherwise.
+ * 
+ * Returns -1 on failure and errno is set, or 0 on success.
+ */
+int write_blocks_to_file(unsigned char *disk, unsigned int inode, int fd);
+
+/**
+ * Writes len bytes from the disk at source to fd, returns false on failure and errno is set.
+ */
+bool write_from_disk(int fd, unsigned char *source, size_t len);
+
 /**
  * Increments dir_entry's rec_len with the next directory entry's rec_len.
  * 